@@ -7,38 +7,154 @@
 #include <array>
 #include <iterator>
 #include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <exception>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#if !defined( _WIN32 )
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+#if defined( FFMPEGPP_HAVE_LIBURING )
+#include <liburing.h>
+#endif
 
 extern "C"
 {
 #include "libavformat/avformat.h"
 #include "libswscale/swscale.h"
+#include "libavfilter/avfilter.h"
+#include "libavfilter/buffersrc.h"
+#include "libavfilter/buffersink.h"
 }
 
 namespace av
 {
-	struct error
+	// thrown for every failure, code holds the AVERROR when there is one
+	struct exception : std::runtime_error
 	{
-		std::string message;
-
-		error( const std::string &m = std::string() ) :
-			message( m ) {}
+		exception( const std::string &what, int code = 0 ) :
+			std::runtime_error( what ),
+			code_( code ) {}
 
-		void operator()( int e ) const
+		int code() const
 		{
-			char buffer[ AV_ERROR_MAX_STRING_SIZE ];
+			return code_;
+		}
+
+		private:
+
+			int code_;
+	};
+
+	// thrown when a deadline passed before an operation finished
+	struct timeout_error : exception
+	{
+		timeout_error( const std::string &what ) :
+			exception( what, AVERROR_EXIT ) {}
+	};
+
+	// thrown when an operation was given up through its cancellation token
+	struct cancelled_error : exception
+	{
+		cancelled_error( const std::string &what ) :
+			exception( what, AVERROR_EXIT ) {}
+	};
+
+	// shared between the thread that decides to give up and the threads doing the work
+	class cancellation
+	{
+		public:
+
+			cancellation() :
+				flag_( std::make_shared< std::atomic< bool > >( false ) ) {}
+
+			void cancel() const
+			{
+				*flag_ = true;
+			}
+
+			bool cancelled() const
+			{
+				return *flag_;
+			}
+
+		private:
+
+			std::shared_ptr< std::atomic< bool > > flag_;
+	};
+
+	inline std::string error_string( int e )
+	{
+		char buffer[ AV_ERROR_MAX_STRING_SIZE ] = { 0 };
+		av_make_error_string( buffer, AV_ERROR_MAX_STRING_SIZE, e );
+		buffer[ AV_ERROR_MAX_STRING_SIZE - 1 ] = 0;
+		return buffer;
+	}
+
+	// describes what was attempted, constructing one costs nothing as the
+	// message is only put together when the error is actually raised
+	struct error
+	{
+		error( const char *m = "", const char *d = nullptr ) :
+			message( m ),
+			detail( d ),
+			owned() {}
 
-			av_make_error_string( buffer, AV_ERROR_MAX_STRING_SIZE, e );
+		// allocates, keep it off the hot path
+		error( const std::string &m ) :
+			message( nullptr ),
+			detail( nullptr ),
+			owned( m ) {}
 
-			auto len = strnlen( buffer, AV_ERROR_MAX_STRING_SIZE );
-			buffer[ len ] = 0;
+		std::string text() const
+		{
+			std::string result = message ? message : owned;
+			if ( detail )
+			{
+				result += ": ";
+				result += detail;
+			}
+			return result;
+		}
 
-			throw std::runtime_error( message + ": " + buffer );
+		[[noreturn]] void operator()( int e ) const
+		{
+			throw exception( text() + ": " + error_string( e ), e );
 		}
 
-		void operator()( const std::string &m ) const
+		[[noreturn]] void operator()( const std::string &m ) const
 		{
-			throw std::runtime_error( message + ": " + m );
+			throw exception( text() + ": " + m );
 		}
+
+		const char *message;
+		const char *detail;
+		std::string owned;
 	};
 
 	template < typename T >
@@ -55,32 +171,333 @@ namespace av
 		return t;
 	}
 
+	// outcome of a non-throwing call, a negative code is an AVERROR
+	struct status
+	{
+		status( int c = 0, const char *m = nullptr ) :
+			code( c ),
+			message( m ) {}
+
+		explicit operator bool() const
+		{
+			return code >= 0;
+		}
+
+		bool eof() const
+		{
+			return code == AVERROR_EOF;
+		}
+
+		bool again() const
+		{
+			return code == AVERROR( EAGAIN );
+		}
+
+		std::string what() const
+		{
+			return std::string( message ? message : "error" ) + ": " + error_string( code );
+		}
+
+		// turns a failure into an exception after all
+		void raise() const
+		{
+			if ( code < 0 )
+			{
+				error( message ? message : "error" )( code );
+			}
+		}
+
+		int code;
+		const char *message;
+	};
+
+	// a value or the status explaining why there is none
+	template < typename T >
+	class result
+	{
+		public:
+
+			result( T &&v ) :
+				status_(),
+				value_( std::move( v ) ) {}
+
+			result( const status &s ) :
+				status_( s ),
+				value_() {}
+
+			explicit operator bool() const
+			{
+				return bool( status_ );
+			}
+
+			const av::status& status() const
+			{
+				return status_;
+			}
+
+			T& value()
+			{
+				status_.raise();
+				return value_;
+			}
+
+			T& operator *()
+			{
+				return value();
+			}
+
+			T* operator ->()
+			{
+				return &value();
+			}
+
+		private:
+
+			av::status status_;
+			T value_;
+	};
+
 	template < typename T, typename D >
 	std::unique_ptr< T, D > make_unique( T *t, D d )
 	{
 		return std::unique_ptr< T, D >( t, d );
 	}
 	
+	// live and peak counts and overhead of the objects owned by wrapped_ptrs and av::buffers,
+	// so leaks and memory hot spots can be seen in production
+	// the overhead is what is known when ownership is taken: the structures, as declared by
+	// the headers compiled against, plus the extradata and io buffers of contexts, and the
+	// full size of av::buffers
+	// pixel and sample buffers of frames and packets are reference counted and not included,
+	// memory_size() and file::memory() measure those
+	namespace memory
+	{
+		enum class kind
+		{
+			frame,
+			packet,
+			codec_context,
+			format_context,
+			io_context,
+			buffer,
+			none
+		};
+
+		static const size_t kinds = static_cast< size_t >( kind::none );
+
+		inline const char* name( kind k )
+		{
+			static const char *names[] = { "frame", "packet", "codec context", "format context", "io context", "buffer", "none" };
+			return names[ static_cast< size_t >( k ) ];
+		}
+
+		struct usage
+		{
+			size_t count;
+			size_t peak_count;
+			size_t overhead;
+			size_t peak_overhead;
+		};
+
+		class accounting
+		{
+			public:
+
+				static accounting& instance()
+				{
+					static accounting result;
+					return result;
+				}
+
+				void acquire( kind k, size_t bytes )
+				{
+					auto &c = counters_[ static_cast< size_t >( k ) ];
+					raise( c.peak_count, c.count.fetch_add( 1, std::memory_order_relaxed ) + 1 );
+					raise( c.peak_bytes, c.bytes.fetch_add( bytes, std::memory_order_relaxed ) + bytes );
+				}
+
+				void release( kind k, size_t bytes )
+				{
+					auto &c = counters_[ static_cast< size_t >( k ) ];
+					c.count.fetch_sub( 1, std::memory_order_relaxed );
+					c.bytes.fetch_sub( bytes, std::memory_order_relaxed );
+				}
+
+				usage get( kind k ) const
+				{
+					auto &c = counters_[ static_cast< size_t >( k ) ];
+					usage result = { c.count.load(), c.peak_count.load(), c.bytes.load(), c.peak_bytes.load() };
+					return result;
+				}
+
+				// starts a new peak measurement from the current usage
+				void reset_peaks()
+				{
+					for ( auto &c : counters_ )
+					{
+						c.peak_count = c.count.load();
+						c.peak_bytes = c.bytes.load();
+					}
+				}
+
+			private:
+
+				struct counters
+				{
+					std::atomic< size_t > count, peak_count, bytes, peak_bytes;
+				};
+
+				accounting() :
+					counters_()
+				{
+					for ( auto &c : counters_ )
+					{
+						c.count = c.peak_count = c.bytes = c.peak_bytes = 0;
+					}
+				}
+
+				static void raise( std::atomic< size_t > &peak, size_t value )
+				{
+					auto current = peak.load( std::memory_order_relaxed );
+					while ( current < value && !peak.compare_exchange_weak( current, value, std::memory_order_relaxed ) )
+					{
+						//
+					}
+				}
+
+				std::array< counters, kinds > counters_;
+		};
+
+		inline usage get( kind k )
+		{
+			return accounting::instance().get( k );
+		}
+
+		// which kind a wrapped pointer is counted as, and its overhead
+		template < typename T >
+		struct traits
+		{
+			static const kind which = kind::none;
+
+			static size_t bytes( const T* )
+			{
+				return 0;
+			}
+		};
+
+		template <>
+		struct traits< AVFrame >
+		{
+			static const kind which = kind::frame;
+
+			static size_t bytes( const AVFrame* )
+			{
+				return sizeof( AVFrame );
+			}
+		};
+
+		template <>
+		struct traits< AVPacket >
+		{
+			static const kind which = kind::packet;
+
+			static size_t bytes( const AVPacket* )
+			{
+				return sizeof( AVPacket );
+			}
+		};
+
+		template <>
+		struct traits< AVCodecContext >
+		{
+			static const kind which = kind::codec_context;
+
+			static size_t bytes( const AVCodecContext *c )
+			{
+				return sizeof( AVCodecContext ) + std::max( c->extradata_size, 0 );
+			}
+		};
+
+		template <>
+		struct traits< AVFormatContext >
+		{
+			static const kind which = kind::format_context;
+
+			static size_t bytes( const AVFormatContext* )
+			{
+				return sizeof( AVFormatContext );
+			}
+		};
+
+		template <>
+		struct traits< AVIOContext >
+		{
+			static const kind which = kind::io_context;
+
+			static size_t bytes( const AVIOContext *c )
+			{
+				return sizeof( AVIOContext ) + std::max( c->buffer_size, 0 );
+			}
+		};
+
+		// returns the bytes charged, which have to be handed back to release
+		template < typename T >
+		size_t acquire( const T *t )
+		{
+			if ( !t || traits< T >::which == kind::none )
+			{
+				return 0;
+			}
+			auto bytes = traits< T >::bytes( t );
+			accounting::instance().acquire( traits< T >::which, bytes );
+			return bytes;
+		}
+
+		template < typename T >
+		void release( const T *t, size_t bytes )
+		{
+			if ( t && traits< T >::which != kind::none )
+			{
+				accounting::instance().release( traits< T >::which, bytes );
+			}
+		}
+	}
+
 	template < typename T, typename D, void Destructor(D*) >
 	struct wrapped_ptr
 	{
 		T *pointer_;
 		void (*destructor_)(D*);
+		size_t bytes_;
 		
 		wrapped_ptr( T *t = nullptr, void d(D*) = Destructor ) :
 			pointer_( t ),
-			destructor_( d )
+			destructor_( d ),
+			bytes_( memory::acquire( t ) )
 		{
 		}
 		
+		// ownership moves along with what was charged for it
 		wrapped_ptr( wrapped_ptr &&rhs ) :
-			pointer_( rhs.release() ),
-			destructor_( rhs.destructor_ ) {}
+			pointer_( rhs.pointer_ ),
+			destructor_( rhs.destructor_ ),
+			bytes_( rhs.bytes_ )
+		{
+			rhs.pointer_ = nullptr;
+			rhs.bytes_ = 0;
+		}
 		
 		wrapped_ptr& operator = ( wrapped_ptr &&rhs )
 		{
-			reset( rhs.release() );
-			destructor_ = rhs.destructor_;
+			if ( this != &rhs )
+			{
+				reset();
+				pointer_ = rhs.pointer_;
+				destructor_ = rhs.destructor_;
+				bytes_ = rhs.bytes_;
+				rhs.pointer_ = nullptr;
+				rhs.bytes_ = 0;
+			}
 			return *this;
 		}
 		
@@ -104,14 +521,26 @@ namespace av
 		
 		void reset( T *t = nullptr )
 		{
-			auto old = pointer_;
+			if ( t == pointer_ )
+			{
+				return;
+			}
+			auto old = release();
 			pointer_ = t;
+			bytes_ = memory::acquire( t );
+			if ( old && destructor_ )
+			{
+				destructor_( old );
+			}
 		}
 		
+		// gives up ownership, the object is no longer counted
 		T* release()
 		{
 			auto old = pointer_;
+			memory::release( old, bytes_ );
 			pointer_ = nullptr;
+			bytes_ = 0;
 			return old;
 		}
 		
@@ -159,21 +588,46 @@ namespace av
 	{
 		buffer( size_t s ) :
 			data_( av_malloc( s ) ),
-			size_( s ) { }
+			size_( s ),
+			allocated_( data_.get() ? s : 0 )
+		{
+			if ( allocated_ )
+			{
+				memory::accounting::instance().acquire( memory::kind::buffer, allocated_ );
+			}
+		}
 
 		buffer() :
 			data_(),
-			size_( 0 ) { }
+			size_( 0 ),
+			allocated_( 0 ) { }
 		
-		buffer( buffer &&rhs ) = default;
+		buffer( buffer &&rhs ) :
+			data_( std::move( rhs.data_ ) ),
+			size_( rhs.size_ ),
+			allocated_( rhs.allocated_ )
+		{
+			rhs.size_ = rhs.allocated_ = 0;
+		}
 
         buffer& operator = ( buffer &&rhs )
         {
-            data_ = std::move( rhs.data_ );
-            size_ = rhs.size_;
+			if ( this != &rhs )
+			{
+				uncount();
+				data_ = std::move( rhs.data_ );
+				size_ = rhs.size_;
+				allocated_ = rhs.allocated_;
+				rhs.size_ = rhs.allocated_ = 0;
+			}
             return *this;
         }
 
+		~buffer()
+		{
+			uncount();
+		}
+
 		unsigned char* data()
 		{
 			return reinterpret_cast< unsigned char* >( data_.get() );
@@ -189,20 +643,75 @@ namespace av
 			return size_;
 		}
 
+		// only reduces the reported size, the allocation is kept as is
+		void shrink( size_t s )
+		{
+			size_ = std::min( size_, s );
+		}
+
+		// hands the memory to the caller, who has to av_free it
+		unsigned char* release()
+		{
+			uncount();
+			size_ = 0;
+			return reinterpret_cast< unsigned char* >( data_.release() );
+		}
+
 		private:
 
             buffer& operator = ( const buffer& );
 
+			void uncount()
+			{
+				if ( allocated_ )
+				{
+					memory::accounting::instance().release( memory::kind::buffer, allocated_ );
+					allocated_ = 0;
+				}
+			}
+
 			typedef wrapped_ptr< void, void, &av_free > data_type;
 
 			data_type data_;
 			size_t size_;
+			size_t allocated_;
 
 	};
 
+	namespace log
+	{
+		// makes the installed router, if any, forget a context that is about to be freed
+		inline void release( const void *context );
+	}
+
 	namespace format
 	{
-		typedef wrapped_ptr< AVFormatContext, AVFormatContext, &avformat_free_context > context;
+		namespace helper
+		{
+			// inputs are closed, which also closes their AVIOContext unless it is a custom one,
+			// outputs have to close the file they opened themselves
+			inline void close( AVFormatContext *ctx )
+			{
+				for ( auto i = 0u; i < ctx->nb_streams; ++i )
+				{
+					log::release( ctx->streams[ i ]->codec );
+				}
+				log::release( ctx );
+
+				if ( ctx->iformat )
+				{
+					avformat_close_input( &ctx );
+					return;
+				}
+				if ( ctx->oformat && !( ctx->oformat->flags & AVFMT_NOFILE ) && !( ctx->flags & AVFMT_FLAG_CUSTOM_IO ) )
+				{
+					avio_closep( &ctx->pb );
+				}
+				avformat_free_context( ctx );
+			}
+		}
+
+		typedef wrapped_ptr< AVFormatContext, AVFormatContext, &helper::close > context;
 	}
 	
 	namespace io
@@ -238,6 +747,12 @@ namespace av
 		}
 	};
 
+	// AVERROR_EOF at the end of the input
+	inline status read_frame( format::context &p, packet &pack, const std::nothrow_t& )
+	{
+		return status( av_read_frame( p.get(), &pack ), "could not read frame" );
+	}
+
 	bool read_frame( format::context &p, packet &pack )
 	{
 		auto result = av_read_frame( p.get(), &pack );
@@ -276,33 +791,226 @@ namespace av
 		{
 			void free( AVCodecContext *ctx )
 			{
+				log::release( ctx );
 				avcodec_free_context( &ctx );
 			}
 		}
 		
 		typedef wrapped_ptr< AVCodecContext, AVCodecContext, &helper::free > context;
 	
-		bool decode_video( AVCodecContext *codec, frame::frame &p, const AVPacket &packet )
+		// outcome of a single send or receive step
+		enum class state
 		{
-			int frameFinished = false;
-			avcodec_decode_video2( codec, p.get(), &frameFinished, &packet ) < error( "could not decode video" );
-            return frameFinished != 0;
-		}
-		
-		AVCodec* open_input( AVCodecContext &ctx )
+			ok,
+			// output has to be received before more input is accepted, or more input is needed for output
+			again,
+			// the codec has been fully flushed
+			eof
+		};
+
+		namespace helper
 		{
-			AVCodec *decoder = nullptr;
-			if ( !ctx.codec )
+			inline state check( int result, const char *message )
 			{
-				decoder = avcodec_find_decoder( ctx.codec_id );
+				if ( result == AVERROR( EAGAIN ) )
+				{
+					return state::again;
+				}
+				if ( result == AVERROR_EOF )
+				{
+					return state::eof;
+				}
+				result < error( message );
+				return state::ok;
 			}
-			avcodec_open2( &ctx, decoder, nullptr ) < av::error( "could not open codec" );
-			return decoder;
 		}
-		
-		AVCodec* open_output( AVCodecContext &ctx )
+
+		// a nullptr packet starts flushing the decoder
+		inline state send_packet( AVCodecContext &ctx, const AVPacket *p )
 		{
-			AVCodec *decoder = nullptr;
+			return helper::check( avcodec_send_packet( &ctx, p ), "could not send packet" );
+		}
+
+		inline state receive_frame( AVCodecContext &ctx, AVFrame &f )
+		{
+			return helper::check( avcodec_receive_frame( &ctx, &f ), "could not receive frame" );
+		}
+
+		// a nullptr frame starts flushing the encoder
+		inline state send_frame( AVCodecContext &ctx, const AVFrame *f )
+		{
+			return helper::check( avcodec_send_frame( &ctx, f ), "could not send frame" );
+		}
+
+		inline state receive_packet( AVCodecContext &ctx, AVPacket &p )
+		{
+			return helper::check( avcodec_receive_packet( &ctx, &p ), "could not receive packet" );
+		}
+
+		// non-throwing variants, EAGAIN and AVERROR_EOF are reported as codes like any other
+		inline status send_packet( AVCodecContext &ctx, const AVPacket *p, const std::nothrow_t& )
+		{
+			return status( avcodec_send_packet( &ctx, p ), "could not send packet" );
+		}
+
+		inline status receive_frame( AVCodecContext &ctx, AVFrame &f, const std::nothrow_t& )
+		{
+			return status( avcodec_receive_frame( &ctx, &f ), "could not receive frame" );
+		}
+
+		inline status send_frame( AVCodecContext &ctx, const AVFrame *f, const std::nothrow_t& )
+		{
+			return status( avcodec_send_frame( &ctx, f ), "could not send frame" );
+		}
+
+		inline status receive_packet( AVCodecContext &ctx, AVPacket &p, const std::nothrow_t& )
+		{
+			return status( avcodec_receive_packet( &ctx, &p ), "could not receive packet" );
+		}
+
+		// errors that only cost the packet or frame they occur in, the decoder resyncs on the next one
+		inline bool recoverable( const status &s )
+		{
+			return s.code == AVERROR_INVALIDDATA || s.code == AVERROR_PATCHWELCOME;
+		}
+
+		// sends a packet to the decoder, or flushes it when p is nullptr, and hands every
+		// frame the decoder can produce to sink
+		// corrupt packets and frames are skipped whether send or receive reports them, any
+		// other error is returned
+		// returns the number of frames produced
+		template < typename Sink >
+		result< size_t > decode( AVCodecContext &ctx, const AVPacket *p, AVFrame &frame, Sink &&sink )
+		{
+			size_t frames = 0;
+
+			for ( ;; )
+			{
+				auto sent = send_packet( ctx, p, std::nothrow );
+				if ( !sent && !sent.again() && !sent.eof() && !recoverable( sent ) )
+				{
+					return sent;
+				}
+
+				auto received = 0;
+				status s;
+				while ( ( s = receive_frame( ctx, frame, std::nothrow ) ) || recoverable( s ) )
+				{
+					if ( !s )
+					{
+						continue;
+					}
+					sink( frame );
+					av_frame_unref( &frame );
+					++received;
+				}
+				frames += received;
+
+				if ( s.eof() )
+				{
+					// fully drained, make the decoder usable again after a flush
+					avcodec_flush_buffers( &ctx );
+					break;
+				}
+
+				if ( !s.again() )
+				{
+					return s;
+				}
+
+				if ( !sent.again() )
+				{
+					if ( p || !sent || !received )
+					{
+						break;
+					}
+					// keep draining until the decoder signals it is fully flushed
+					continue;
+				}
+
+				if ( !received )
+				{
+					return status( AVERROR_BUG, "decoder neither accepts input nor produces output" );
+				}
+			}
+
+			return std::move( frames );
+		}
+
+		// sends a frame to the encoder, or flushes it when input is nullptr, and hands
+		// every packet the encoder can produce to sink, with timestamps in the codec time base
+		// true means the encoder accepts more input, false that it has been flushed
+		template < typename Sink >
+		result< bool > encode( AVCodecContext &ctx, const AVFrame *input, AVPacket &p, Sink &&sink )
+		{
+			for ( ;; )
+			{
+				auto sent = send_frame( ctx, input, std::nothrow );
+				if ( !sent && !sent.again() && !sent.eof() )
+				{
+					return sent;
+				}
+
+				auto received = 0;
+				status s;
+				while ( ( s = receive_packet( ctx, p, std::nothrow ) ) )
+				{
+					sink( p );
+					av_packet_unref( &p );
+					++received;
+				}
+
+				if ( s.eof() )
+				{
+					return false;
+				}
+
+				if ( !s.again() )
+				{
+					return s;
+				}
+
+				// the encoder only refuses input while it has output pending
+				if ( !sent.again() )
+				{
+					return !sent.eof();
+				}
+
+				if ( !received )
+				{
+					return status( AVERROR_BUG, "encoder neither accepts input nor produces output" );
+				}
+			}
+		}
+
+		// decodes a video packet, or flushes the decoder when packet is nullptr, and hands
+		// every frame it yields to sink, p is the frame decoded into
+		// returns the number of frames, a packet can yield none or several
+		template < typename Sink >
+		size_t decode_video( AVCodecContext *codec, frame::frame &p, const AVPacket *packet, Sink &&sink )
+		{
+			auto result = decode( *codec, packet, *p, std::forward< Sink >( sink ) );
+			if ( !result )
+			{
+				error( "could not decode video" )( result.status().code );
+			}
+			return *result;
+		}
+		
+		AVCodec* open_input( AVCodecContext &ctx )
+		{
+			AVCodec *decoder = nullptr;
+			if ( !ctx.codec )
+			{
+				decoder = avcodec_find_decoder( ctx.codec_id );
+			}
+			avcodec_open2( &ctx, decoder, nullptr ) < av::error( "could not open codec" );
+			return decoder;
+		}
+		
+		AVCodec* open_output( AVCodecContext &ctx )
+		{
+			AVCodec *decoder = nullptr;
 			if ( !ctx.codec )
 			{
 				decoder = avcodec_find_encoder( ctx.codec_id );
@@ -310,6 +1018,102 @@ namespace av
 			avcodec_open2( &ctx, decoder, nullptr ) < av::error( "could not open codec" );
 			return decoder;
 		}
+
+		// encoder settings applied when the encoder is opened
+		struct options
+		{
+			options() :
+				threads( -1 ),
+				thread_type( -1 ),
+				preset(),
+				tune(),
+				values() {}
+
+			// 0 lets the encoder use one thread per core, -1 leaves the context's setting alone
+			int threads;
+			// FF_THREAD_FRAME and/or FF_THREAD_SLICE, frame threading adds a frame of latency per thread
+			// -1 leaves the context's setting alone
+			int thread_type;
+			// speed / quality trade off of encoders that have them, e.g. libx264's "veryfast" and "film"
+			std::string preset, tune;
+			// any other AVCodecContext or private encoder option
+			std::vector< std::pair< std::string, std::string > > values;
+
+			options& set( const std::string &key, const std::string &value )
+			{
+				values.push_back( std::make_pair( key, value ) );
+				return *this;
+			}
+
+			options& set( const std::string &key, int64_t value )
+			{
+				using std::to_string;
+				return set( key, to_string( value ) );
+			}
+		};
+
+		namespace helper
+		{
+			inline void free( AVDictionary *d )
+			{
+				av_dict_free( &d );
+			}
+		}
+
+		typedef std::unique_ptr< AVDictionary, void(*)( AVDictionary* ) > dictionary;
+
+		inline dictionary make_dictionary( const options &o )
+		{
+			AVDictionary *d = nullptr;
+			if ( !o.preset.empty() )
+			{
+				av_dict_set( &d, "preset", o.preset.c_str(), 0 );
+			}
+			if ( !o.tune.empty() )
+			{
+				av_dict_set( &d, "tune", o.tune.c_str(), 0 );
+			}
+			for ( auto &v : o.values )
+			{
+				av_dict_set( &d, v.first.c_str(), v.second.c_str(), 0 );
+			}
+			return dictionary( d, &helper::free );
+		}
+
+		// opens the encoder with the given options, returns the names of the options
+		// the encoder did not recognize
+		std::vector< std::string > open_output( AVCodecContext &ctx, const options &o )
+		{
+			const AVCodec *encoder = ctx.codec ? ctx.codec : avcodec_find_encoder( ctx.codec_id );
+			if ( !encoder )
+			{
+				error( "could not open codec" )( std::string( "no encoder for " ) + avcodec_get_name( ctx.codec_id ) );
+			}
+
+			if ( o.threads >= 0 )
+			{
+				ctx.thread_count = o.threads;
+			}
+			if ( o.thread_type >= 0 )
+			{
+				ctx.thread_type = o.thread_type;
+			}
+
+			auto dict = make_dictionary( o );
+			auto d = dict.release();
+			auto result = avcodec_open2( &ctx, encoder, &d );
+			dict.reset( d );
+			result < av::error( "could not open codec" );
+
+			// avcodec_open2 leaves only the entries it did not consume
+			std::vector< std::string > rejected;
+			AVDictionaryEntry *e = nullptr;
+			while ( ( e = av_dict_get( dict.get(), "", e, AV_DICT_IGNORE_SUFFIX ) ) )
+			{
+				rejected.push_back( e->key );
+			}
+			return rejected;
+		}
 		
 		context make_context( const AVCodec *codec )
 		{
@@ -326,7 +1130,17 @@ namespace av
 	{
 		namespace context
 		{
-			typedef wrapped_ptr< AVIOContext, void, &av_free > AVIOContextPtr;
+			namespace helper
+			{
+				// avio may have replaced the buffer it was given, so it is freed through the context
+				inline void free( AVIOContext *ctx )
+				{
+					av_freep( &ctx->buffer );
+					av_free( ctx );
+				}
+			}
+
+			typedef wrapped_ptr< AVIOContext, AVIOContext, &helper::free > AVIOContextPtr;
 
 
 			namespace callback
@@ -346,28 +1160,44 @@ namespace av
 						AVIOContextPtr(),
 						read( [](uint8_t*,int) { return 0; } ),
 						write( [](uint8_t*,int) { return 0; } ),
-						seek( [](int64_t,int) { return 0; } ),
-						buffer_() {}
+						seek( [](int64_t,int) { return 0; } ) {}
 				
 					type( AVIOContextPtr &&ctx ) :
 						AVIOContextPtr( std::move( ctx ) ),
 						read( [](uint8_t*,int) { return 0; } ),
 						write( [](uint8_t*,int) { return 0; } ),
-						seek( [](int64_t,int) { return 0; } ),
-						buffer_() {}
+						seek( [](int64_t,int) { return 0; } ) {}
 				
-					type( buffer &&b ) :
+					// the AVIOContext takes over the buffer
+					type( buffer &&b, bool writable = false ) :
 						AVIOContextPtr(),
 						read( [](uint8_t*,int) { return 0; } ),
 						write( [](uint8_t*,int) { return 0; } ),
-						seek( [](int64_t,int) { return 0; } ),
-						buffer_( std::move( b ) )
+						seek( [](int64_t,int) { return 0; } )
 					{
-						reset( avio_alloc_context( b.data(), b.size(), false, this, &callback::read, &callback::write, &callback::seek ) );
+						auto size = b.size();
+						auto data = b.release();
+						auto ctx = avio_alloc_context( data, size, writable, this, &callback::read, &callback::write, &callback::seek );
+						if ( !ctx )
+						{
+							av_free( data );
+							error( "could not allocate io context" )( AVERROR( ENOMEM ) );
+						}
+						reset( ctx );
 					}
 
-				
-					type( type&& ) {}
+					// the AVIOContext refers back to this object, so it has to follow a move
+					type( type &&rhs ) :
+						AVIOContextPtr( std::move( rhs ) ),
+						read( std::move( rhs.read ) ),
+						write( std::move( rhs.write ) ),
+						seek( std::move( rhs.seek ) )
+					{
+						if ( auto ctx = get() )
+						{
+							ctx->opaque = this;
+						}
+					}
 				
 					operator bool() const
 					{
@@ -379,11 +1209,6 @@ namespace av
 					std::function< int( uint8_t*, int ) > read, write;
 					std::function< int64_t(int64_t,int) > seek;
 
-					void buffer( buffer &&b )
-					{
-						buffer_ = std::move( b );
-					}
-
 				private:
 
 					inline int read_cb( uint8_t *b, int s )
@@ -401,8 +1226,6 @@ namespace av
 						return seek( b, s );
 					}
 
-					av::buffer buffer_;
-
 					friend int callback::read( void*, uint8_t*, int );
 					friend int callback::write( void*, uint8_t*, int );
 					friend int64_t callback::seek( void*, int64_t, int );
@@ -435,542 +1258,6721 @@ namespace av
 			{
 				return alloc( buffer( s ) );
 			}
-		}
-	}
-	
-	namespace format
-	{
-		context make_context( const io::context::type &t = io::context::type() )
-		{
-			auto ctx = avformat_alloc_context();
-			if ( t )
+
+			type alloc_output( size_t s = 4096 )
 			{
-				ctx->pb = t.get();
-				ctx->flags = AVFMT_FLAG_CUSTOM_IO;
+				return type( buffer( s ), true );
 			}
-			return ctx;
 		}
-	}
 
-	typedef std::function< bool( AVFrame &frame ) > callback_t;
+		// collects everything a muxer writes in a chain of av::buffer segments,
+		// seeking back to patch headers is supported
+		// the object is referenced by the AVIOContext, so it can not be moved
+		class memory_output
+		{
+			public:
 
-	struct stream
-	{
-		typedef wrapped_ptr< AVStream, void, &av_free > stream_type;
+				memory_output( size_t segment_size = 64 * 1024, size_t io_buffer_size = 4096 ) :
+					segment_size_( std::max< size_t >( segment_size, 1 ) ),
+					segments_(),
+					position_( 0 ),
+					size_( 0 ),
+					context_( context::alloc_output( io_buffer_size ) )
+				{
+					context_.write = [this]( uint8_t *b, int s ) { return write( b, s ); };
+					context_.seek = [this]( int64_t offset, int whence ) { return seek( offset, whence ); };
+					context_->seekable = AVIO_SEEKABLE_NORMAL;
+				}
 
-		static void null_deleter( void* ) {}
-		
-		stream( const format::context &fmt, const AVCodec *codec ) :
-            impl_( std::make_shared< implementation_t >( avformat_new_stream( fmt.get(), codec ) ) ) {}
+				context::type& context()
+				{
+					return context_;
+				}
 
-		explicit stream( AVStream *ptr = nullptr ) :
-            impl_( std::make_shared< implementation_t >( ptr ) ) {}
-		
-//		stream( stream && ) = default;
-//		stream( const stream & ) = default;
-//		
-//		stream& operator = ( stream && ) = default;
-//		stream& operator = ( const stream & ) = default;
-//		
-        operator bool() const
-		{
-			return bool( impl_->cb_ );
-		}
+				// number of bytes written so far, not counting what is still in the AVIOContext buffer
+				size_t size() const
+				{
+					return size_;
+				}
 
-		AVStream* get() const
-		{
-			return impl_->stream_.get();
-		}
+				// hands out the written segments, the last one shrunk to its used size
+				std::vector< av::buffer > release()
+				{
+					avio_flush( context_.get() );
 
-		AVStream* operator ->() const
-		{
-			return impl_->stream_.get();
-		}
+					auto count = ( size_ + segment_size_ - 1 ) / segment_size_;
+					segments_.resize( count );
+					if ( count )
+					{
+						segments_.back().shrink( size_ - ( count - 1 ) * segment_size_ );
+					}
 
-		void open_output( const callback_t &cb )
-		{
-			impl_->stream_->discard = AVDISCARD_DEFAULT;
-			impl_->cb_ = cb;
-			if ( impl_->stream_->codec )
-			{
-				codec::open_output( *impl_->stream_->codec );
-			}
-		}
+					std::vector< av::buffer > result( std::move( segments_ ) );
+					segments_.clear();
+					position_ = size_ = 0;
+					return result;
+				}
 
-		void open_input( const callback_t &cb )
-		{
-			impl_->stream_->discard = AVDISCARD_DEFAULT;
-			impl_->cb_ = cb;
-			if ( impl_->stream_->codec )
-			{
-				codec::open_input( *impl_->stream_->codec );
-			}
-		}
+			private:
 
-		void close()
-		{
-			impl_->stream_->discard = AVDISCARD_ALL;
-			impl_->cb_ = callback_t();
-		}
+				memory_output( const memory_output& );
+				memory_output& operator = ( const memory_output& );
 
-		bool call( AVFrame &frame )
+				int write( const uint8_t *data, int size )
+				{
+					auto remaining = static_cast< size_t >( std::max( size, 0 ) );
+					while ( remaining )
+					{
+						auto index = position_ / segment_size_;
+						auto offset = position_ % segment_size_;
+						while ( segments_.size() <= index )
+						{
+							segments_.push_back( av::buffer( segment_size_ ) );
+							if ( !segments_.back().data() )
+							{
+								return AVERROR( ENOMEM );
+							}
+						}
+
+						auto count = std::min( remaining, segment_size_ - offset );
+						std::copy( data, data + count, segments_[ index ].data() + offset );
+						data += count;
+						remaining -= count;
+						position_ += count;
+					}
+					size_ = std::max( size_, position_ );
+					return size;
+				}
+
+				int64_t seek( int64_t offset, int whence )
+				{
+					switch( whence & ~AVSEEK_FORCE )
+					{
+						case AVSEEK_SIZE:
+							return size_;
+						case SEEK_SET:
+							break;
+						case SEEK_CUR:
+							offset += position_;
+							break;
+						case SEEK_END:
+							offset += size_;
+							break;
+						default:
+							return AVERROR( EINVAL );
+					}
+
+					if ( offset < 0 )
+					{
+						return AVERROR( EINVAL );
+					}
+
+					// seeking past the end leaves a gap, it reads back as whatever the segment held
+					position_ = offset;
+					return position_;
+				}
+
+				size_t segment_size_;
+				std::vector< av::buffer > segments_;
+				size_t position_, size_;
+				context::type context_;
+		};
+
+#if !defined( _WIN32 )
+		// reads a file ahead of the demuxer, keeping a number of fixed size blocks in
+		// flight so i/o latency is hidden behind decoding
+		// uses io_uring when built with FFMPEGPP_HAVE_LIBURING and the kernel supports
+		// it, otherwise a small pool of pread threads
+		class read_ahead
 		{
-			return impl_->cb_( frame );
-		}
+			public:
 
-		private:
-		
-			struct implementation_t
-			{
-				implementation_t( AVStream *ptr = nullptr ) :
-					stream_( ptr, &null_deleter ),
-					cb_(),
-					packet_(),
-					frame_( frame::alloc() ){}
-				
-				implementation_t( stream_type &&ptr ) :
-					stream_( std::move( ptr ) ),
-					cb_(),
-					packet_(),
-					frame_( frame::alloc() ) {}
-				
-				stream_type stream_;
-				callback_t cb_;
-				packet packet_;
-				frame::frame frame_;
-			};
-			std::shared_ptr< implementation_t > impl_;
-	};
-
-	bool encode( stream &stream, AVPacket &p, AVFrame &frame )
-	{
-		int frame_complete = false;
-		switch( stream->codec->codec_type )
-		{
-			case AVMEDIA_TYPE_VIDEO:
-			{
-				if ( stream.call( frame ) )
+				struct options
 				{
-					auto result = avcodec_encode_video2( stream->codec, &p, &frame, &frame_complete );
-					result = avcodec_encode_video2( stream->codec, &p, nullptr, &frame_complete );
-					result < error( "could not encode video" );
-				}
-				return frame_complete != false;
-			}
-			case AVMEDIA_TYPE_AUDIO:
-			case AVMEDIA_TYPE_SUBTITLE:
-			case AVMEDIA_TYPE_UNKNOWN:
-			case AVMEDIA_TYPE_DATA:
-			case AVMEDIA_TYPE_ATTACHMENT:
-			case AVMEDIA_TYPE_NB:
-				break;
-		}
-		return false;
-	}
+					options() :
+						block_size( 256 * 1024 ),
+						blocks( 8 ),
+						threads( 2 ),
+						use_io_uring( true ) {}
 
-	bool decode( stream &stream, AVPacket &p, AVFrame &frame )
-	{
-		int frame_complete = false;
-		
-		switch( stream->codec->codec_type )
-		{
-			case AVMEDIA_TYPE_VIDEO:
-			{
-				auto result = avcodec_decode_video2( stream->codec, &frame, &frame_complete, &p );
-				p.size = 0;
-				if ( result < 0 )
-				{
-					// error, do something usefull
-				}
-				if ( frame_complete )
-				{
-					stream.call( frame );
-				}
-                return result > 0;
-			}
-			case AVMEDIA_TYPE_AUDIO:
-			{
-				auto result = avcodec_decode_audio4( stream->codec, &frame, &frame_complete, &p );
-				if ( result < 0 )
-				{
-					// error, do something usefull
-					p.size = 0;
-				}
-				else
-				{
-					p.size -= result;
-					p.data += result;
-				}
-				if ( frame_complete )
+					size_t block_size;
+					// number of blocks kept in flight ahead of the read position
+					size_t blocks;
+					// worker threads of the pread fallback
+					size_t threads;
+					bool use_io_uring;
+				};
+
+				struct statistics
 				{
-					stream.call( frame );
-				}
-                return result > 0;
-			}
-			case AVMEDIA_TYPE_SUBTITLE:
-			case AVMEDIA_TYPE_UNKNOWN:
-			case AVMEDIA_TYPE_DATA:
-			case AVMEDIA_TYPE_ATTACHMENT:
-			case AVMEDIA_TYPE_NB:
-				p.size = 0;
-				break;
-		}
-		return false;
-	}
-	
-	void interleaved_write_frame( format::context &fmt, packet &p )
-	{
-		av_interleaved_write_frame( fmt.get(), &p ) < error( "could not write frame" );
-	}
+					// blocks requested from the backend, and the ones thrown away by a seek
+					size_t submitted, cancelled;
+					// reads served from a completed block, and reads that had to wait for one
+					size_t hits, stalls;
+					std::chrono::steady_clock::duration stalled;
+				};
 
-	namespace format
-	{
-		template < AVMediaType compare, typename Iter, typename Output >
-		void copy_if( Iter start, Iter end, Output out )
-		{
-			while ( start != end )
-			{
-				if ( ( *start )->codec->codec_type == compare )
+				read_ahead( const char *filename, const options &o = options() ) :
+					options_( o ),
+					fd_( ::open( filename, O_RDONLY ) ),
+					size_( 0 ),
+					position_( 0 ),
+					slots_( std::max< size_t >( o.blocks, 1 ) ),
+					pending_( 0 ),
+					statistics_(),
+					backend_()
 				{
-					*out = *start;
-				}
-				++start;
-			}
-		}
+					if ( fd_ < 0 )
+					{
+						error( "read ahead", filename )( strerror( errno ) );
+					}
 
-		struct file
-		{
-			file() :
-				format_(),
-				streams_() {}
-			
-			file( context &&f ) :
-				format_( std::move( f ) ),
-				streams_() {}
+					struct stat st;
+					if ( fstat( fd_, &st ) == 0 )
+					{
+						size_ = st.st_size;
+					}
 
-            file( file &&rhs ) :
-				format_( std::move( rhs.format_ ) ),
-				streams_( std::move( rhs.streams_ ) ) {}
-			
-			file& operator = ( file &&rhs )
-			{
-				format_ = std::move( rhs.format_ );
-				streams_ = std::move( rhs.streams_ );
-				return *this;
-			}
-			
-			bool encode( packet &p, AVFrame &frame )
-			{
-				if ( av::encode( streams_[ p.stream_index ], p, frame ) )
-				{
-					av::interleaved_write_frame( format_, p );
-					return true;
-				}
-				return false;
-			}
-			
-			inline bool encode( packet &p, frame::frame &frame )
-			{
-				return encode( p, *frame );
-			}
+					options_.block_size = std::max< size_t >( options_.block_size, 4096 );
+					for ( auto &s : slots_ )
+					{
+						s.data.resize( options_.block_size );
+					}
 
-			void encode_all( packet &&p, frame::frame &&frame )
-			{
-				for ( auto &s : streams_ )
-				{
-					p.stream_index = s->id;
-					
-					while ( encode( p, *frame ) )
+#if defined( FFMPEGPP_HAVE_LIBURING )
+					if ( options_.use_io_uring )
 					{
-						//
+						backend_ = uring_backend::create( fd_, slots_.size() );
+					}
+#endif
+					if ( !backend_ )
+					{
+						backend_.reset( new thread_backend( fd_, std::max< size_t >( options_.threads, 1 ) ) );
 					}
 				}
-			}
 
-			bool decode( packet &p, AVFrame &frame )
-			{
-				if ( p.size || av::read_frame( format_, p ) )
+				~read_ahead()
 				{
-					av::decode( streams_[ p.stream_index ], p, frame );
+					cancel();
+					backend_.reset();
+					::close( fd_ );
 				}
-				else
+
+				int read( uint8_t *buffer, int size )
 				{
-					AVPacket nill = { 0 };
+					if ( position_ >= size_ )
+					{
+						return AVERROR_EOF;
+					}
 
-					bool again = false;
-					for ( auto &s : streams_ )
+					const auto bs = static_cast< int64_t >( options_.block_size );
+					const auto block = position_ / bs;
+					const auto first = window_start();
+
+					if ( block < first || block >= first + static_cast< int64_t >( slots_.size() ) )
 					{
-						if ( s )
+						cancel();
+					}
+
+					refill( block );
+
+					auto &s = slots_[ block % slots_.size() ];
+					if ( s.state == state::pending )
+					{
+						++statistics_.stalls;
+						auto start = std::chrono::steady_clock::now();
+						while ( s.state == state::pending )
 						{
-							again |= av::decode( s, nill, frame );
+							complete();
 						}
+						statistics_.stalled += std::chrono::steady_clock::now() - start;
+					}
+					else
+					{
+						++statistics_.hits;
 					}
-					
-					return again;
-				}
-				
-				return true;
-			}
 
-			inline bool decode( packet &p, frame::frame &frame )
-			{
-				return decode( p, *frame );
-			}
+					if ( s.result < 0 )
+					{
+						auto e = s.result;
+						s.state = state::idle;
+						return AVERROR( static_cast< int >( -e ) );
+					}
 
-			void decode_all( packet &&p, frame::frame &&frame )
-			{
-				while ( decode( p, *frame ) )
-				{
-					//
-				}
-			}
+					auto offset = position_ - block * bs;
+					auto count = std::min< int64_t >( size, s.result - offset );
+					if ( count <= 0 )
+					{
+						return AVERROR_EOF;
+					}
 
-			inline void decode_all()
-			{
-				decode_all( av::packet(), av::frame::alloc() );
-			}
+					std::copy( s.data.data() + offset, s.data.data() + offset + count, buffer );
+					position_ += count;
 
-			void add_stream( AVStream *s )
-			{
-				streams_.push_back( stream( s ) );
-			}
-			
-			stream& add_stream( const AVCodec &codec )
-			{
-				streams_.push_back( stream( format_, &codec ) );
-				return streams_.back();
-			}
-			
-			stream& add_stream( AVCodecID codecid )
-			{
-				if ( auto codec = avcodec_find_encoder( codecid ) )
-				{
-					return add_stream( *codec );
+					// start reading further ahead as soon as a block is consumed
+					if ( position_ / bs != block )
+					{
+						s.state = state::idle;
+						refill( position_ / bs );
+					}
+
+					return static_cast< int >( count );
 				}
-				using std::to_string;
-				throw std::runtime_error( "could not find codec for id: " + to_string( codecid ) );
-			}
 
-			std::vector< stream > streams( AVMediaType filter = AVMEDIA_TYPE_NB ) const
-			{
-				std::vector< stream > result;
-				auto inserter = std::back_insert_iterator< std::vector< stream > >( result );
-				auto s = streams_.begin(), e = streams_.end();
+				int64_t seek( int64_t offset, int whence )
+				{
+					switch( whence & ~AVSEEK_FORCE )
+					{
+						case AVSEEK_SIZE:
+							return size_;
+						case SEEK_SET:
+							break;
+						case SEEK_CUR:
+							offset += position_;
+							break;
+						case SEEK_END:
+							offset += size_;
+							break;
+						default:
+							return AVERROR( EINVAL );
+					}
 
-				switch( filter )
+					if ( offset < 0 )
+					{
+						return AVERROR( EINVAL );
+					}
+
+					// blocks outside of the new window are cancelled by the next read
+					position_ = offset;
+					return position_;
+				}
+
+				int64_t size() const
 				{
-					case AVMEDIA_TYPE_VIDEO:
-						copy_if< AVMEDIA_TYPE_VIDEO >( s, e, inserter );
-						break;
-					case AVMEDIA_TYPE_AUDIO:
-						copy_if< AVMEDIA_TYPE_AUDIO >( s, e, inserter );
-						break;
-					case AVMEDIA_TYPE_SUBTITLE:
-						copy_if< AVMEDIA_TYPE_SUBTITLE >( s, e, inserter );
-						break;
-					case AVMEDIA_TYPE_UNKNOWN:
-						copy_if< AVMEDIA_TYPE_UNKNOWN >( s, e, inserter );
-						break;
-					case AVMEDIA_TYPE_DATA:
-						copy_if< AVMEDIA_TYPE_DATA >( s, e, inserter );
-						break;
-					case AVMEDIA_TYPE_ATTACHMENT:
-						copy_if< AVMEDIA_TYPE_ATTACHMENT >( s, e, inserter );
-						break;
-					case AVMEDIA_TYPE_NB:
-						result.assign( s, e );
-						break;
+					return size_;
 				}
-				return result;
-			}
-			
-			void find_stream_info( AVDictionary **options = nullptr  )
-			{
-				avformat_find_stream_info( format_.get(), options ) < error( "could not find stream info" );
-				
-				for ( auto i = 0u; i < format_->nb_streams; ++i )
+
+				const statistics& stats() const
 				{
-					if ( auto s = format_->streams[ i ] )
-					{
-						s->discard = AVDISCARD_ALL;
-						add_stream( s );
-					}
+					return statistics_;
 				}
-			}
-		
-			AVFormatContext* ctx() const
-			{
-				return format_.get();
-			}
 
 			private:
 
-                file( const file& );
+				read_ahead( const read_ahead& );
+				read_ahead& operator = ( const read_ahead& );
 
-				context format_;
-				std::vector< stream > streams_;
-		};
+				enum class state { idle, pending, ready };
 
-		file open_input( const char *filename, context &&p, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
-		{
-			// release, instead of get, since avformat_open_input will free ptr on error
-			auto ptr = p.release();
-			avformat_open_input( &ptr, filename, fmt, options ) < error( std::string( "open input: " ) + filename );
-			p.reset( ptr );
-			
-			file result( std::move( p ) );
-			
-			result.find_stream_info( options );
+				struct slot
+				{
+					slot() :
+						data(),
+						block( -1 ),
+						state( state::idle ),
+						result( 0 ) {}
 
-			return result;
-		}
+					std::vector< uint8_t > data;
+					int64_t block;
+					read_ahead::state state;
+					// bytes read or a negative errno
+					int64_t result;
+				};
 
-		inline file open_input( const char *filename, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
-		{
-			return open_input( filename, av::format::make_context(), fmt, options );
-		}
+				struct completion
+				{
+					size_t slot;
+					int64_t result;
+				};
 
-		inline file open_input( const char *filename, const io::context::type &ctx, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
-		{
-			return open_input( filename, make_context( ctx ), fmt, options );
-		}
+				class backend
+				{
+					public:
+						virtual ~backend() {}
+						virtual void submit( size_t slot, uint8_t *buffer, size_t length, int64_t offset ) = 0;
+						// blocks until the next request finishes
+						virtual completion complete() = 0;
+						// best effort, the request still completes, possibly with -ECANCELED
+						virtual void cancel( size_t slot ) = 0;
+				};
 
-		inline file open_input( const io::context::type &ctx, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
-		{
-			return open_input( "", make_context( ctx ), fmt, options );
-		}
-		
-		file open_output( const char *filename )
-		{
-			AVFormatContext *ctx = nullptr;
-			avformat_alloc_output_context2( &ctx, nullptr, nullptr, filename ) < error( "could not open output format" );
-			
-			if ( !( ctx->flags & AVFMT_NOFILE ) )
-			{
-				avio_open( &ctx->pb, filename, AVIO_FLAG_WRITE ) < error( "could not open output file" );
-			}
+				class thread_backend : public backend
+				{
+					public:
 
-			return file( context( ctx ) );
-		}
-	}
-}
+						thread_backend( int fd, size_t threads ) :
+							fd_( fd ),
+							mutex_(),
+							requests_changed_(),
+							completions_changed_(),
+							requests_(),
+							completions_(),
+							workers_(),
+							stop_( false )
+						{
+							for ( auto i = 0u; i < threads; ++i )
+							{
+								workers_.emplace_back( [this]{ work(); } );
+							}
+						}
 
-namespace sws
-{
-	class context
-	{
-		std::vector< SwsContext* > contexts_;
-    };
+						~thread_backend()
+						{
+							{
+								std::lock_guard< std::mutex > lock( mutex_ );
+								stop_ = true;
+								requests_changed_.notify_all();
+							}
+							for ( auto &w : workers_ )
+							{
+								w.join();
+							}
+						}
 
-    template < typename T >
-    struct array_helper : std::array< T, AV_NUM_DATA_POINTERS >
-    {
-        typedef std::array< T, AV_NUM_DATA_POINTERS > base;
-		
-		template < typename Iterator >
-		array_helper( Iterator a, Iterator b ) :
-			base()
-		{
-			auto count = std::min< size_t >( std::distance( a, b ), AV_NUM_DATA_POINTERS );
-			std::copy( a, a + count, base::begin() );
-			std::fill( base::begin() + count, base::end(), T() );
-		}
+						void submit( size_t slot, uint8_t *buffer, size_t length, int64_t offset )
+						{
+							std::lock_guard< std::mutex > lock( mutex_ );
+							request r = { slot, buffer, length, offset };
+							requests_.push_back( r );
+							requests_changed_.notify_one();
+						}
 
-        array_helper( T v = T() ) :
-            base()
-        {
-            base::operator []( 0 ) = v;
-            std::fill( base::begin() + 1, base::end(), T() );
-        }
+						completion complete()
+						{
+							std::unique_lock< std::mutex > lock( mutex_ );
+							completions_changed_.wait( lock, [this]{ return !completions_.empty(); } );
+							auto result = completions_.front();
+							completions_.pop_front();
+							return result;
+						}
 
-        array_helper( T a, T b ) :
-            base()
-        {
-            base::operator []( 0 ) = a;
-            base::operator []( 1 ) = b;
-            std::fill( base::begin() + 2, base::end(), T() );
-        }
+						void cancel( size_t slot )
+						{
+							std::lock_guard< std::mutex > lock( mutex_ );
+							auto i = std::find_if( requests_.begin(), requests_.end(), [slot]( const request &r ){ return r.slot == slot; } );
+							if ( i != requests_.end() )
+							{
+								requests_.erase( i );
+								completion c = { slot, -ECANCELED };
+								completions_.push_back( c );
+								completions_changed_.notify_one();
+							}
+						}
 
-        array_helper( T a, T b, T c ) :
-            base()
-        {
-            base::operator []( 0 ) = a;
-            base::operator []( 1 ) = b;
-            base::operator []( 2 ) = c;
-            std::fill( base::begin() + 3, base::end(), T() );
-        }
+					private:
 
-        array_helper( T a, T b, T c, T d ) :
-            base()
-        {
-            base::operator []( 0 ) = a;
-            base::operator []( 1 ) = b;
-            base::operator []( 2 ) = c;
-            base::operator []( 3 ) = d;
-            std::fill( base::begin() + 4, base::end(), T() );
-        }
-    };
+						struct request
+						{
+							size_t slot;
+							uint8_t *buffer;
+							size_t length;
+							int64_t offset;
+						};
 
-    typedef array_helper< int > strides_t;
-    typedef array_helper< uint8_t* > pointers_t;
+						void work()
+						{
+							std::unique_lock< std::mutex > lock( mutex_ );
+							for ( ;; )
+							{
+								requests_changed_.wait( lock, [this]{ return stop_ || !requests_.empty(); } );
+								if ( stop_ )
+								{
+									return;
+								}
+
+								auto r = requests_.front();
+								requests_.pop_front();
+
+								lock.unlock();
+								int64_t done = 0;
+								while ( done < static_cast< int64_t >( r.length ) )
+								{
+									auto n = ::pread( fd_, r.buffer + done, r.length - done, r.offset + done );
+									if ( n < 0 && errno == EINTR )
+									{
+										continue;
+									}
+									if ( n <= 0 )
+									{
+										done = n < 0 && !done ? -errno : done;
+										break;
+									}
+									done += n;
+								}
+								lock.lock();
+
+								completion c = { r.slot, done };
+								completions_.push_back( c );
+								completions_changed_.notify_one();
+							}
+						}
+
+						int fd_;
+						std::mutex mutex_;
+						std::condition_variable requests_changed_, completions_changed_;
+						std::deque< request > requests_;
+						std::deque< completion > completions_;
+						std::vector< std::thread > workers_;
+						bool stop_;
+				};
+
+#if defined( FFMPEGPP_HAVE_LIBURING )
+				class uring_backend : public backend
+				{
+					public:
+
+						// returns nullptr when io_uring is not available
+						static std::unique_ptr< backend > create( int fd, size_t entries )
+						{
+							std::unique_ptr< uring_backend > result( new uring_backend( fd ) );
+							if ( io_uring_queue_init( static_cast< unsigned >( entries * 2 ), &result->ring_, 0 ) < 0 )
+							{
+								return nullptr;
+							}
+							result->initialized_ = true;
+							return std::move( result );
+						}
+
+						~uring_backend()
+						{
+							if ( initialized_ )
+							{
+								io_uring_queue_exit( &ring_ );
+							}
+						}
+
+						void submit( size_t slot, uint8_t *buffer, size_t length, int64_t offset )
+						{
+							auto sqe = get_sqe();
+							io_uring_prep_read( sqe, fd_, buffer, static_cast< unsigned >( length ), offset );
+							io_uring_sqe_set_data( sqe, reinterpret_cast< void* >( slot ) );
+							io_uring_submit( &ring_ );
+						}
+
+						completion complete()
+						{
+							for ( ;; )
+							{
+								io_uring_cqe *cqe = nullptr;
+								auto r = io_uring_wait_cqe( &ring_, &cqe );
+								if ( r == -EINTR )
+								{
+									continue;
+								}
+								r < error( "io_uring wait" );
+
+								auto data = reinterpret_cast< uintptr_t >( io_uring_cqe_get_data( cqe ) );
+								completion c = { static_cast< size_t >( data ), cqe->res };
+								io_uring_cqe_seen( &ring_, cqe );
+
+								// completions of the cancel requests themselves are of no interest
+								if ( data != cancel_marker() )
+								{
+									return c;
+								}
+							}
+						}
+
+						void cancel( size_t slot )
+						{
+							auto sqe = get_sqe();
+							io_uring_prep_cancel( sqe, reinterpret_cast< void* >( slot ), 0 );
+							io_uring_sqe_set_data( sqe, reinterpret_cast< void* >( cancel_marker() ) );
+							io_uring_submit( &ring_ );
+						}
+
+					private:
+
+						uring_backend( int fd ) :
+							fd_( fd ),
+							ring_(),
+							initialized_( false ) {}
+
+						static uintptr_t cancel_marker()
+						{
+							return std::numeric_limits< uintptr_t >::max();
+						}
+
+						io_uring_sqe* get_sqe()
+						{
+							auto sqe = io_uring_get_sqe( &ring_ );
+							if ( !sqe )
+							{
+								io_uring_submit( &ring_ );
+								sqe = io_uring_get_sqe( &ring_ ) || error( "io_uring submission queue full" );
+							}
+							return sqe;
+						}
+
+						int fd_;
+						io_uring ring_;
+						bool initialized_;
+				};
+#endif
+
+				int64_t window_start() const
+				{
+					auto result = std::numeric_limits< int64_t >::max();
+					for ( auto &s : slots_ )
+					{
+						if ( s.state != state::idle )
+						{
+							result = std::min( result, s.block );
+						}
+					}
+					return result == std::numeric_limits< int64_t >::max() ? position_ / static_cast< int64_t >( options_.block_size ) : result;
+				}
+
+				// makes sure every block of the window starting at first is ready or in flight
+				void refill( int64_t first )
+				{
+					const auto bs = static_cast< int64_t >( options_.block_size );
+					for ( auto b = first; b < first + static_cast< int64_t >( slots_.size() ) && b * bs < size_; ++b )
+					{
+						auto index = b % slots_.size();
+						auto &s = slots_[ index ];
+						if ( s.state != state::idle && s.block == b )
+						{
+							continue;
+						}
+						if ( s.state == state::pending )
+						{
+							continue;
+						}
+						s.block = b;
+						s.state = state::pending;
+						s.result = 0;
+						++pending_;
+						++statistics_.submitted;
+						backend_->submit( index, s.data.data(), std::min< int64_t >( bs, size_ - b * bs ), b * bs );
+					}
+				}
+
+				// reaps one completion and updates its slot
+				void complete()
+				{
+					auto c = backend_->complete();
+					auto &s = slots_[ c.slot ];
+					s.result = c.result;
+					s.state = c.result == -ECANCELED ? state::idle : state::ready;
+					--pending_;
+				}
+
+				// drops all blocks, waiting for in flight requests since their buffers are reused
+				void cancel()
+				{
+					for ( auto i = 0u; i < slots_.size(); ++i )
+					{
+						if ( slots_[ i ].state == state::pending )
+						{
+							backend_->cancel( i );
+							++statistics_.cancelled;
+						}
+					}
+					while ( pending_ )
+					{
+						complete();
+					}
+					for ( auto &s : slots_ )
+					{
+						s.state = state::idle;
+					}
+				}
+
+				options options_;
+				int fd_;
+				int64_t size_, position_;
+				std::vector< slot > slots_;
+				size_t pending_;
+				statistics statistics_;
+				std::unique_ptr< backend > backend_;
+		};
+
+		namespace context
+		{
+			// a context that reads filename through a read_ahead
+			type open_read_ahead( const char *filename, const read_ahead::options &o = read_ahead::options(), size_t buffer_size = 32768 )
+			{
+				auto reader = std::make_shared< read_ahead >( filename, o );
+				auto result = alloc( buffer_size );
+				result.read = [reader]( uint8_t *b, int s ) { return reader->read( b, s ); };
+				result.seek = [reader]( int64_t offset, int whence ) { return reader->seek( offset, whence ); };
+				result->seekable = AVIO_SEEKABLE_NORMAL;
+				return result;
+			}
+		}
+#endif
+	}
 	
-	template < typename Destination, typename Source >
-	void assign_if_null( Destination &dest, const Source &src )
+	namespace format
 	{
-		if ( !dest )
+		context make_context( const io::context::type &t = io::context::type() )
 		{
-			dest = src;
+			auto ctx = avformat_alloc_context();
+			if ( t )
+			{
+				ctx->pb = t.get();
+				ctx->flags = AVFMT_FLAG_CUSTOM_IO;
+			}
+			return ctx;
 		}
 	}
-	
-	struct helper
+
+	typedef std::function< bool( AVFrame &frame ) > callback_t;
+
+	inline size_t memory_size( const AVPacket &p );
+	inline size_t memory_size( const AVFrame &f );
+
+	struct stream
 	{
-		void to_avframe( AVFrame &f ) const
+		typedef wrapped_ptr< AVStream, void, &av_free > stream_type;
+
+		static void null_deleter( void* ) {}
+		
+		stream( const format::context &fmt, const AVCodec *codec ) :
+            impl_( std::make_shared< implementation_t >( avformat_new_stream( fmt.get(), codec ) ) ) {}
+
+		explicit stream( AVStream *ptr = nullptr ) :
+            impl_( std::make_shared< implementation_t >( ptr ) ) {}
+		
+//		stream( stream && ) = default;
+//		stream( const stream & ) = default;
+//		
+//		stream& operator = ( stream && ) = default;
+//		stream& operator = ( const stream & ) = default;
+//		
+        operator bool() const
 		{
-			std::copy( stride.begin(), stride.end(), f.linesize );
-			std::copy( data.begin(), data.end(), f.data );
-			f.format = format;
-			f.width = width;
-			f.height = height;
+			return bool( impl_->cb_ );
 		}
-		void to_avframe( av::frame::frame &f ) const
+
+		AVStream* get() const
 		{
-			to_avframe( *f );
+			return impl_->stream_.get();
 		}
-		av::frame::frame to_avframe() const
+
+		AVStream* operator ->() const
 		{
-			auto f = av::frame::alloc();
-			to_avframe( f );
-			return f;
+			return impl_->stream_.get();
 		}
-		strides_t stride;
-		pointers_t data;
-		AVPixelFormat format;
-		size_t width, height;
-	};
 
-    void convert( const helper &src, helper &dst, int flags = 0 )
-	{
-		auto ctx = sws_getCachedContext( nullptr, src.width, src.height, src.format, dst.width, dst.height, dst.format, flags, nullptr, nullptr, nullptr );
-		
-        sws_scale( ctx, src.data.data(), src.stride.data(), 0, src.height, dst.data.data(), dst.stride.data() );
-		
-		sws_freeContext( ctx );
-	}
+		void open_output( const callback_t &cb )
+		{
+			impl_->stream_->discard = AVDISCARD_DEFAULT;
+			impl_->cb_ = cb;
+			if ( impl_->stream_->codec )
+			{
+				codec::open_output( *impl_->stream_->codec );
+			}
+		}
 
-    void convert( AVFrame &frame, const pointers_t &dst, const strides_t &strides, AVPixelFormat desired, size_t width = 0, size_t height = 0, int flags = 0 )
-	{
-		assign_if_null( width, frame.width );
-		assign_if_null( height, frame.height );
+		// returns the names of the options the encoder did not recognize
+		std::vector< std::string > open_output( const callback_t &cb, const codec::options &o )
+		{
+			impl_->stream_->discard = AVDISCARD_DEFAULT;
+			impl_->cb_ = cb;
+			if ( impl_->stream_->codec )
+			{
+				return codec::open_output( *impl_->stream_->codec, o );
+			}
+			return std::vector< std::string >();
+		}
 
-		auto ctx = sws_getCachedContext( nullptr, frame.width, frame.height, static_cast< AVPixelFormat >( frame.format ), width, height, desired, flags, nullptr, nullptr, nullptr );
+		void open_input( const callback_t &cb )
+		{
+			impl_->stream_->discard = AVDISCARD_DEFAULT;
+			impl_->cb_ = cb;
+			if ( impl_->stream_->codec )
+			{
+				codec::open_input( *impl_->stream_->codec );
+			}
+		}
 
-		auto &picture = reinterpret_cast< AVPicture& >( frame );
-        sws_scale( ctx, picture.data, picture.linesize, 0, frame.height, dst.data(), strides.data() );
-	}
+		void close()
+		{
+			impl_->stream_->discard = AVDISCARD_ALL;
+			impl_->cb_ = callback_t();
+		}
 
-	void convert( AVFrame &frame, void *dst, int stride, AVPixelFormat desired, size_t width = 0, size_t height = 0, int flags = 0 )
-	{
-        convert( frame, pointers_t( reinterpret_cast< uint8_t* >( dst ) ), strides_t( stride ), desired, width, height, flags );
+		bool call( AVFrame &frame )
+		{
+			++impl_->frames_;
+			return impl_->cb_( frame );
+		}
+
+		// number of frames handed to the callback so far
+		size_t frames() const
+		{
+			return impl_->frames_;
+		}
+
+		// bytes held by the frame and packet the stream keeps between calls
+		size_t buffered() const
+		{
+			return av::memory_size( *impl_->frame_.get() ) + av::memory_size( impl_->packet_ );
+		}
+
+		private:
+		
+			struct implementation_t
+			{
+				implementation_t( AVStream *ptr = nullptr ) :
+					stream_( ptr, &null_deleter ),
+					cb_(),
+					packet_(),
+					frame_( frame::alloc() ),
+					frames_( 0 ) {}
+				
+				implementation_t( stream_type &&ptr ) :
+					stream_( std::move( ptr ) ),
+					cb_(),
+					packet_(),
+					frame_( frame::alloc() ),
+					frames_( 0 ) {}
+				
+				stream_type stream_;
+				callback_t cb_;
+				packet packet_;
+				frame::frame frame_;
+				size_t frames_;
+			};
+			std::shared_ptr< implementation_t > impl_;
+	};
+
+	typedef std::function< void( AVPacket &packet ) > packet_callback_t;
+
+	bool encode( stream &stream, AVPacket &p, const AVFrame *input, const packet_callback_t &write );
+
+	namespace helper
+	{
+		// only audio and video go through the send/receive api
+		inline bool has_frames( const AVCodecContext &ctx )
+		{
+			switch( ctx.codec_type )
+			{
+				case AVMEDIA_TYPE_VIDEO:
+				case AVMEDIA_TYPE_AUDIO:
+					return true;
+				case AVMEDIA_TYPE_SUBTITLE:
+				case AVMEDIA_TYPE_UNKNOWN:
+				case AVMEDIA_TYPE_DATA:
+				case AVMEDIA_TYPE_ATTACHMENT:
+				case AVMEDIA_TYPE_NB:
+					break;
+			}
+			return false;
+		}
+	}
+
+	// pulls a frame from the stream callback and sends it to the encoder, once the
+	// callback returns false the encoder is flushed instead
+	// every packet the encoder can produce is handed to write, with its timestamps
+	// rescaled to the stream time base
+	// returns false once the encoder has been flushed
+	bool encode( stream &stream, AVPacket &p, AVFrame &frame, const packet_callback_t &write )
+	{
+		auto &ctx = *stream->codec;
+		if ( !helper::has_frames( ctx ) )
+		{
+			return false;
+		}
+
+		return encode( stream, p, stream.call( frame ) ? &frame : nullptr, write );
+	}
+
+	// sends a single frame, or flushes the encoder when frame is nullptr
+	// the non-throwing variant reports encoder failures in the result, true means
+	// the encoder accepts more input
+	result< bool > encode( stream &stream, AVPacket &p, const AVFrame *input, const packet_callback_t &write, const std::nothrow_t& )
+	{
+		auto &ctx = *stream->codec;
+		if ( !helper::has_frames( ctx ) )
+		{
+			return false;
+		}
+
+		return codec::encode( ctx, input, p, [&]( AVPacket &out )
+		{
+			out.stream_index = stream->index;
+			av_packet_rescale_ts( &out, ctx.time_base, stream->time_base );
+			write( out );
+		} );
+	}
+
+	bool encode( stream &stream, AVPacket &p, const AVFrame *input, const packet_callback_t &write )
+	{
+		return encode( stream, p, input, write, std::nothrow ).value();
+	}
+
+	// codec::decode with the stream callback as sink, an empty packet flushes
+	result< size_t > decode( stream &stream, const AVPacket &p, AVFrame &frame, const std::nothrow_t& )
+	{
+		auto &ctx = *stream->codec;
+		if ( !helper::has_frames( ctx ) )
+		{
+			return 0;
+		}
+
+		const bool flush = !p.data && !p.size;
+		return codec::decode( ctx, flush ? nullptr : &p, frame, [&]( AVFrame &f )
+		{
+			stream.call( f );
+		} );
+	}
+
+	size_t decode( stream &stream, const AVPacket &p, AVFrame &frame )
+	{
+		return decode( stream, p, frame, std::nothrow ).value();
+	}
+
+	// decoder owned by a single thread, opened from the parameters of a stream
+	// unlike copies of av::stream, which share their codec, frame and callback through
+	// a reference count, nothing here is shared with the stream or with other states,
+	// so each thread can decode its own stream, or its own file, without synchronizing
+	class decode_state
+	{
+		public:
+
+			explicit decode_state( const AVStream &s, int threads = 1 ) :
+				codec_( codec::make_context( avcodec_find_decoder( s.codecpar->codec_id ) || error( "could not find decoder", avcodec_get_name( s.codecpar->codec_id ) ) ) ),
+				frame_( frame::alloc() ),
+				index_( s.index ),
+				frames_( 0 )
+			{
+				avcodec_parameters_to_context( codec_.get(), s.codecpar ) < error( "could not copy codec parameters" );
+				codec_->pkt_timebase = s.time_base;
+				codec_->thread_count = threads;
+				codec::open_input( *codec_ );
+			}
+
+			decode_state( decode_state && ) = default;
+			decode_state& operator = ( decode_state && ) = default;
+
+			// index of the stream whose packets this state decodes
+			int index() const
+			{
+				return index_;
+			}
+
+			// number of frames decoded so far
+			size_t frames() const
+			{
+				return frames_;
+			}
+
+			AVCodecContext& codec()
+			{
+				return *codec_;
+			}
+
+			// hands every frame the packet yields to cb, see codec::decode
+			template < typename Callback >
+			result< size_t > decode( const AVPacket *p, Callback &&cb, const std::nothrow_t& )
+			{
+				auto result = codec::decode( *codec_, p, *frame_, std::forward< Callback >( cb ) );
+				if ( result )
+				{
+					frames_ += *result;
+				}
+				return result;
+			}
+
+			template < typename Callback >
+			size_t decode( const AVPacket *p, Callback &&cb )
+			{
+				return decode( p, std::forward< Callback >( cb ), std::nothrow ).value();
+			}
+
+		private:
+
+			decode_state( const decode_state& );
+			decode_state& operator = ( const decode_state& );
+
+			codec::context codec_;
+			frame::frame frame_;
+			int index_;
+			size_t frames_;
+	};
+	
+	void interleaved_write_frame( format::context &fmt, packet &p )
+	{
+		av_interleaved_write_frame( fmt.get(), &p ) < error( "could not write frame" );
+	}
+
+	inline status interleaved_write_frame( format::context &fmt, AVPacket &p, const std::nothrow_t& )
+	{
+		return status( av_interleaved_write_frame( fmt.get(), &p ), "could not write frame" );
+	}
+
+	namespace helper
+	{
+		// av_packet_free expects a AVPacket** as well
+		inline void packet_free( AVPacket *p )
+		{
+			av_packet_free( &p );
+		}
+	}
+
+	// a reference counted packet that can be handed between threads
+	typedef wrapped_ptr< AVPacket, AVPacket, &helper::packet_free > packet_ptr;
+
+	// takes over the payload of p, which is left empty
+	inline packet_ptr packet_move( AVPacket &p )
+	{
+		packet_ptr result( av_packet_alloc() || error( "could not allocate packet" ) );
+		av_packet_move_ref( result.get(), &p );
+		return result;
+	}
+
+	namespace frame
+	{
+		inline frame ref( const AVFrame &f )
+		{
+			auto result = alloc();
+			av_frame_ref( result.get(), &f ) < error( "could not reference frame" );
+			return result;
+		}
+
+		// recycles AVFrame structures, released frames are unreferenced so their
+		// data goes back to whatever pool it came from
+		class pool
+		{
+			public:
+
+				pool() :
+					mutex_(),
+					frames_() {}
+
+				frame acquire()
+				{
+					{
+						std::lock_guard< std::mutex > lock( mutex_ );
+						if ( !frames_.empty() )
+						{
+							auto result = std::move( frames_.back() );
+							frames_.pop_back();
+							return result;
+						}
+					}
+					return alloc();
+				}
+
+				void release( frame &&f )
+				{
+					if ( !f.get() )
+					{
+						return;
+					}
+					av_frame_unref( f.get() );
+					std::lock_guard< std::mutex > lock( mutex_ );
+					frames_.push_back( std::move( f ) );
+				}
+
+				size_t size() const
+				{
+					std::lock_guard< std::mutex > lock( mutex_ );
+					return frames_.size();
+				}
+
+			private:
+
+				pool( const pool& );
+				pool& operator = ( const pool& );
+
+				mutable std::mutex mutex_;
+				std::vector< frame > frames_;
+		};
+	}
+
+	// approximate number of bytes held by a packet or frame
+	inline size_t memory_size( const AVPacket &p )
+	{
+		return sizeof( AVPacket ) + std::max( p.size, 0 );
+	}
+
+	inline size_t memory_size( const AVFrame &f )
+	{
+		size_t result = sizeof( AVFrame );
+		auto counted = false;
+		for ( auto b : f.buf )
+		{
+			if ( b )
+			{
+				result += b->size;
+				counted = true;
+			}
+		}
+		for ( auto i = 0; i < f.nb_extended_buf; ++i )
+		{
+			result += f.extended_buf[ i ]->size;
+		}
+		if ( !counted )
+		{
+			for ( auto i = 0; i < AV_NUM_DATA_POINTERS && f.data[ i ]; ++i )
+			{
+				result += std::abs( f.linesize[ i ] ) * std::max( f.height, 1 );
+			}
+		}
+		return result;
+	}
+
+	inline size_t memory_size( const packet_ptr &p )
+	{
+		return memory_size( *p.get() );
+	}
+
+	inline size_t memory_size( const frame::frame &f )
+	{
+		return memory_size( *f.get() );
+	}
+
+	template < typename T > class bounded_queue;
+
+	// a byte limit shared by a set of queues, pushing into any of them blocks
+	// while the total would exceed the limit, which back-pressures the producer
+	class memory_budget
+	{
+		public:
+
+			struct usage
+			{
+				size_t limit, used, peak, stalls;
+			};
+
+			explicit memory_budget( size_t limit = std::numeric_limits< size_t >::max() ) :
+				mutex_(),
+				space_(),
+				limit_( limit ),
+				used_( 0 ),
+				peak_( 0 ),
+				stalls_( 0 ) {}
+
+			usage current() const
+			{
+				std::lock_guard< std::mutex > lock( mutex_ );
+				usage result = { limit_, used_, peak_, stalls_ };
+				return result;
+			}
+
+			void limit( size_t l )
+			{
+				std::lock_guard< std::mutex > lock( mutex_ );
+				limit_ = l;
+				space_.notify_all();
+			}
+
+		private:
+
+			memory_budget( const memory_budget& );
+			memory_budget& operator = ( const memory_budget& );
+
+			bool fits( size_t bytes ) const
+			{
+				return used_ + bytes <= limit_;
+			}
+
+			// waits until bytes fit or the predicate allows to continue anyway
+			template < typename Predicate >
+			void wait( std::unique_lock< std::mutex > &lock, size_t bytes, Predicate p )
+			{
+				if ( !fits( bytes ) && !p() )
+				{
+					++stalls_;
+					space_.wait( lock, [&]{ return fits( bytes ) || p(); } );
+				}
+			}
+
+			void acquire( size_t bytes )
+			{
+				used_ += bytes;
+				peak_ = std::max( peak_, used_ );
+			}
+
+			void release( size_t bytes )
+			{
+				used_ -= bytes;
+				space_.notify_all();
+			}
+
+			template < typename T > friend class bounded_queue;
+
+			mutable std::mutex mutex_;
+			std::condition_variable space_;
+			size_t limit_, used_, peak_, stalls_;
+	};
+
+	// a fifo of packets or frames that charges its contents to a memory_budget
+	// a queue may always hold one item regardless of the budget, so a consumer
+	// waiting on an empty queue can never be starved by the other queues
+	template < typename T >
+	class bounded_queue
+	{
+		public:
+
+			struct occupancy
+			{
+				size_t items, bytes, peak_items, peak_bytes;
+			};
+
+			explicit bounded_queue( const std::shared_ptr< memory_budget > &budget = std::make_shared< memory_budget >(), size_t max_items = std::numeric_limits< size_t >::max() ) :
+				budget_( budget ),
+				not_empty_(),
+				items_(),
+				max_items_( max_items ),
+				bytes_( 0 ),
+				peak_items_( 0 ),
+				peak_bytes_( 0 ),
+				closed_( false ) {}
+
+			// blocks while the budget is exhausted, returns false when the queue was closed
+			bool push( T &&item )
+			{
+				auto bytes = memory_size( item );
+				std::unique_lock< std::mutex > lock( budget_->mutex_ );
+				budget_->wait( lock, bytes, [this]{ return closed_ || items_.empty(); } );
+				if ( items_.size() >= max_items_ && !closed_ )
+				{
+					++budget_->stalls_;
+					budget_->space_.wait( lock, [this]{ return closed_ || items_.size() < max_items_; } );
+				}
+				return insert( std::move( item ), bytes );
+			}
+
+			// returns false instead of blocking when the item does not fit
+			bool try_push( T &&item )
+			{
+				auto bytes = memory_size( item );
+				std::lock_guard< std::mutex > lock( budget_->mutex_ );
+				if ( ( !budget_->fits( bytes ) && !items_.empty() ) || items_.size() >= max_items_ )
+				{
+					return false;
+				}
+				return insert( std::move( item ), bytes );
+			}
+
+			// blocks until an item is available, returns false when closed and drained
+			bool pop( T &item )
+			{
+				std::unique_lock< std::mutex > lock( budget_->mutex_ );
+				not_empty_.wait( lock, [this]{ return closed_ || !items_.empty(); } );
+				return remove( item );
+			}
+
+			bool try_pop( T &item )
+			{
+				std::lock_guard< std::mutex > lock( budget_->mutex_ );
+				return remove( item );
+			}
+
+			// wakes up all waiting producers and consumers, queued items can still be popped
+			void close()
+			{
+				std::lock_guard< std::mutex > lock( budget_->mutex_ );
+				closed_ = true;
+				not_empty_.notify_all();
+				budget_->space_.notify_all();
+			}
+
+			bool closed() const
+			{
+				std::lock_guard< std::mutex > lock( budget_->mutex_ );
+				return closed_;
+			}
+
+			void clear()
+			{
+				std::lock_guard< std::mutex > lock( budget_->mutex_ );
+				items_.clear();
+				budget_->release( bytes_ );
+				bytes_ = 0;
+			}
+
+			occupancy current() const
+			{
+				std::lock_guard< std::mutex > lock( budget_->mutex_ );
+				occupancy result = { items_.size(), bytes_, peak_items_, peak_bytes_ };
+				return result;
+			}
+
+			const std::shared_ptr< memory_budget >& budget() const
+			{
+				return budget_;
+			}
+
+			~bounded_queue()
+			{
+				clear();
+			}
+
+		private:
+
+			bounded_queue( const bounded_queue& );
+			bounded_queue& operator = ( const bounded_queue& );
+
+			bool insert( T &&item, size_t bytes )
+			{
+				if ( closed_ )
+				{
+					return false;
+				}
+				items_.push_back( std::make_pair( std::move( item ), bytes ) );
+				bytes_ += bytes;
+				budget_->acquire( bytes );
+				peak_items_ = std::max( peak_items_, items_.size() );
+				peak_bytes_ = std::max( peak_bytes_, bytes_ );
+				not_empty_.notify_one();
+				return true;
+			}
+
+			bool remove( T &item )
+			{
+				if ( items_.empty() )
+				{
+					return false;
+				}
+				item = std::move( items_.front().first );
+				auto bytes = items_.front().second;
+				items_.pop_front();
+				bytes_ -= bytes;
+				budget_->release( bytes );
+				return true;
+			}
+
+			std::shared_ptr< memory_budget > budget_;
+			std::condition_variable not_empty_;
+			std::deque< std::pair< T, size_t > > items_;
+			size_t max_items_, bytes_, peak_items_, peak_bytes_;
+			bool closed_;
+	};
+
+	typedef bounded_queue< packet_ptr > packet_queue;
+	typedef bounded_queue< frame::frame > frame_queue;
+
+	// a stream callback that queues a reference to every decoded frame
+	inline callback_t enqueue( frame_queue &queue )
+	{
+		return [&queue]( AVFrame &f )
+		{
+			return queue.push( frame::ref( f ) );
+		};
+	}
+
+	// decodes the next queued packet, returns false once the queue is closed and drained
+	inline bool decode( stream &s, packet_queue &queue, AVFrame &frame )
+	{
+		packet_ptr p;
+		if ( !queue.pop( p ) )
+		{
+			const AVPacket nill = { 0 };
+			decode( s, nill, frame );
+			return false;
+		}
+
+		decode( s, *p, frame );
+		return true;
+	}
+
+	namespace format
+	{
+		template < AVMediaType compare, typename Iter, typename Output >
+		void copy_if( Iter start, Iter end, Output out )
+		{
+			while ( start != end )
+			{
+				if ( ( *start )->codec->codec_type == compare )
+				{
+					*out = *start;
+				}
+				++start;
+			}
+		}
+
+		// the streams of a file of one media type, iterated by reference
+		// nothing is copied or allocated, so no reference counts are touched, the view
+		// is only valid as long as the streams of the file do not change
+		template < typename Stream >
+		class stream_view
+		{
+			public:
+
+				class iterator
+				{
+					public:
+
+						typedef std::forward_iterator_tag iterator_category;
+						typedef Stream value_type;
+						typedef std::ptrdiff_t difference_type;
+						typedef Stream* pointer;
+						typedef Stream& reference;
+
+						iterator( Stream *p, Stream *end, AVMediaType filter ) :
+							p_( p ),
+							end_( end ),
+							filter_( filter )
+						{
+							skip();
+						}
+
+						Stream& operator *() const
+						{
+							return *p_;
+						}
+
+						Stream* operator ->() const
+						{
+							return p_;
+						}
+
+						iterator& operator ++()
+						{
+							++p_;
+							skip();
+							return *this;
+						}
+
+						iterator operator ++( int )
+						{
+							auto result = *this;
+							++*this;
+							return result;
+						}
+
+						bool operator == ( const iterator &rhs ) const
+						{
+							return p_ == rhs.p_;
+						}
+
+						bool operator != ( const iterator &rhs ) const
+						{
+							return p_ != rhs.p_;
+						}
+
+					private:
+
+						void skip()
+						{
+							while ( p_ != end_ && filter_ != AVMEDIA_TYPE_NB && ( *p_ )->codec->codec_type != filter_ )
+							{
+								++p_;
+							}
+						}
+
+						Stream *p_;
+						Stream *end_;
+						AVMediaType filter_;
+				};
+
+				stream_view( Stream *begin, Stream *end, AVMediaType filter = AVMEDIA_TYPE_NB ) :
+					begin_( begin ),
+					end_( end ),
+					filter_( filter ) {}
+
+				iterator begin() const
+				{
+					return iterator( begin_, end_, filter_ );
+				}
+
+				iterator end() const
+				{
+					return iterator( end_, end_, filter_ );
+				}
+
+				bool empty() const
+				{
+					return begin() == end();
+				}
+
+				size_t size() const
+				{
+					return std::distance( begin(), end() );
+				}
+
+			private:
+
+				Stream *begin_;
+				Stream *end_;
+				AVMediaType filter_;
+		};
+
+		// limits applied before the input is opened, used to get to the first frame quickly
+		struct probe_options
+		{
+			probe_options() :
+				probesize( 0 ),
+				format_probesize( 0 ),
+				analyzeduration( 0 ),
+				fps_probe_size( -1 ),
+				flags( 0 ),
+				streams() {}
+
+			// maximum number of bytes read by avformat_find_stream_info, 0 keeps the default
+			int64_t probesize;
+			// maximum number of bytes read to detect the container, 0 keeps the default
+			int format_probesize;
+			// maximum duration analyzed by avformat_find_stream_info in AV_TIME_BASE units, 0 keeps the default
+			int64_t analyzeduration;
+			// number of frames used to estimate the frame rate, -1 keeps the default
+			int fps_probe_size;
+			// extra AVFMT_FLAG_* flags, e.g. AVFMT_FLAG_NOBUFFER
+			int flags;
+			// media types the caller is going to open, empty means all of them
+			// when every stream of these types is fully described by the container
+			// header, avformat_find_stream_info is skipped altogether
+			std::vector< AVMediaType > streams;
+
+			static probe_options low_latency()
+			{
+				probe_options result;
+				result.probesize = 32 * 1024;
+				result.format_probesize = 2048;
+				result.analyzeduration = AV_TIME_BASE / 2;
+				result.fps_probe_size = 0;
+				result.flags = AVFMT_FLAG_NOBUFFER | AVFMT_FLAG_DISCARD_CORRUPT;
+				return result;
+			}
+
+			bool wants( AVMediaType type ) const
+			{
+				return streams.empty() || std::find( streams.begin(), streams.end(), type ) != streams.end();
+			}
+
+			void apply( AVFormatContext &ctx ) const
+			{
+				if ( probesize > 0 ) ctx.probesize = probesize;
+				if ( format_probesize > 0 ) ctx.format_probesize = format_probesize;
+				if ( analyzeduration > 0 ) ctx.max_analyze_duration = analyzeduration;
+				if ( fps_probe_size >= 0 ) ctx.fps_probe_size = fps_probe_size;
+				ctx.flags |= flags;
+			}
+		};
+
+		// wall clock time spent getting a file ready, measured from the start of open_input
+		struct open_timing
+		{
+			typedef std::chrono::steady_clock clock;
+
+			open_timing() :
+				start( clock::now() ),
+				open(),
+				probe(),
+				first_frame(),
+				probed( false ) {}
+
+			clock::time_point start;
+			// avformat_open_input done
+			clock::duration open;
+			// stream parameters known
+			clock::duration probe;
+			// first frame handed to a stream callback, zero until then
+			clock::duration first_frame;
+			// false when avformat_find_stream_info could be skipped
+			bool probed;
+
+			clock::duration elapsed() const
+			{
+				return clock::now() - start;
+			}
+		};
+
+		namespace helper
+		{
+			// true when the parameters are complete enough to open a decoder without probing
+			inline bool has_parameters( const AVCodecParameters &par )
+			{
+				if ( par.codec_id == AV_CODEC_ID_NONE )
+				{
+					return false;
+				}
+				switch( par.codec_type )
+				{
+					case AVMEDIA_TYPE_VIDEO:
+						return par.width > 0 && par.height > 0 && par.format != AV_PIX_FMT_NONE;
+					case AVMEDIA_TYPE_AUDIO:
+						return par.sample_rate > 0 && par.channels > 0 && par.format != AV_SAMPLE_FMT_NONE;
+					case AVMEDIA_TYPE_SUBTITLE:
+					case AVMEDIA_TYPE_DATA:
+					case AVMEDIA_TYPE_ATTACHMENT:
+						return true;
+					case AVMEDIA_TYPE_UNKNOWN:
+					case AVMEDIA_TYPE_NB:
+						break;
+				}
+				return false;
+			}
+		}
+
+		// codec parameters and stream layout as found by avformat_find_stream_info
+		struct stream_info
+		{
+			typedef std::unique_ptr< AVCodecParameters, void(*)( AVCodecParameters* ) > parameters_type;
+
+			static void free_parameters( AVCodecParameters *p )
+			{
+				avcodec_parameters_free( &p );
+			}
+
+			static parameters_type make_parameters()
+			{
+				return parameters_type( avcodec_parameters_alloc() || error( "could not allocate codec parameters" ), &free_parameters );
+			}
+
+			struct entry
+			{
+				entry() :
+					parameters( make_parameters() ),
+					time_base(),
+					avg_frame_rate(),
+					r_frame_rate(),
+					start_time( AV_NOPTS_VALUE ),
+					duration( AV_NOPTS_VALUE ),
+					nb_frames( 0 ) {}
+
+				parameters_type parameters;
+				AVRational time_base, avg_frame_rate, r_frame_rate;
+				int64_t start_time, duration, nb_frames;
+			};
+
+			stream_info() :
+				streams(),
+				start_time( AV_NOPTS_VALUE ),
+				duration( AV_NOPTS_VALUE ),
+				bit_rate( 0 ) {}
+
+			stream_info( stream_info &&rhs ) :
+				streams( std::move( rhs.streams ) ),
+				start_time( rhs.start_time ),
+				duration( rhs.duration ),
+				bit_rate( rhs.bit_rate ) {}
+
+			static stream_info from( const AVFormatContext &ctx )
+			{
+				stream_info result;
+				result.start_time = ctx.start_time;
+				result.duration = ctx.duration;
+				result.bit_rate = ctx.bit_rate;
+				result.streams.resize( ctx.nb_streams );
+				for ( auto i = 0u; i < ctx.nb_streams; ++i )
+				{
+					auto &e = result.streams[ i ];
+					auto s = ctx.streams[ i ];
+					avcodec_parameters_from_context( e.parameters.get(), s->codec ) < error( "could not copy codec parameters" );
+					e.time_base = s->time_base;
+					e.avg_frame_rate = s->avg_frame_rate;
+					e.r_frame_rate = s->r_frame_rate;
+					e.start_time = s->start_time;
+					e.duration = s->duration;
+					e.nb_frames = s->nb_frames;
+				}
+				return result;
+			}
+
+			// true when this describes the streams the demuxer found in the header
+			bool matches( const AVFormatContext &ctx ) const
+			{
+				if ( ctx.nb_streams != streams.size() )
+				{
+					return false;
+				}
+				for ( auto i = 0u; i < ctx.nb_streams; ++i )
+				{
+					auto &par = *ctx.streams[ i ]->codecpar;
+					auto &cached = *streams[ i ].parameters;
+					if ( par.codec_type != cached.codec_type || par.codec_id != cached.codec_id )
+					{
+						return false;
+					}
+				}
+				return true;
+			}
+
+			std::vector< entry > streams;
+			int64_t start_time, duration, bit_rate;
+
+			private:
+
+				stream_info( const stream_info& );
+				stream_info& operator = ( const stream_info& );
+		};
+
+		// zero means no limit
+		struct deadlines
+		{
+			deadlines() :
+				open( 0 ),
+				read( 0 ),
+				total( 0 ),
+				token() {}
+
+			// opening and probing the input
+			std::chrono::milliseconds open;
+			// a single read, so a stalled input is given up on
+			std::chrono::milliseconds read;
+			// everything, from the start of opening
+			std::chrono::milliseconds total;
+			cancellation token;
+		};
+
+		// libavformat's interrupt callback, polled during blocking io, and checked between
+		// packets by the file, remembers why it fired so the right error can be raised
+		class interrupt
+		{
+			public:
+
+				typedef std::chrono::steady_clock clock;
+
+				enum class reason
+				{
+					none,
+					timeout,
+					cancelled
+				};
+
+				interrupt( const deadlines &d ) :
+					deadlines_( d ),
+					total_( d.total.count() ? clock::now() + d.total : clock::time_point::max() ),
+					phase_( clock::time_point::max() ),
+					phase_name_( "" ),
+					reason_( reason::none ) {}
+
+				// starts the deadline of a single step, a zero duration disarms it
+				void arm( std::chrono::milliseconds d, const char *name )
+				{
+					phase_ = d.count() ? clock::now() + d : clock::time_point::max();
+					phase_name_ = name;
+				}
+
+				void arm_open()
+				{
+					arm( deadlines_.open, "open" );
+				}
+
+				void arm_read()
+				{
+					arm( deadlines_.read, "read" );
+				}
+
+				void disarm()
+				{
+					arm( std::chrono::milliseconds( 0 ), "" );
+				}
+
+				bool triggered()
+				{
+					if ( halted() )
+					{
+						return true;
+					}
+					if ( clock::now() >= phase_ )
+					{
+						reason_ = reason::timeout;
+						return true;
+					}
+					return false;
+				}
+
+				// cancelled or past the total deadline, the step deadline is not considered
+				// since it is disarmed between steps
+				bool halted()
+				{
+					if ( reason_ != reason::none )
+					{
+						return true;
+					}
+					if ( deadlines_.token.cancelled() )
+					{
+						reason_ = reason::cancelled;
+						return true;
+					}
+					if ( clock::now() >= total_ )
+					{
+						reason_ = reason::timeout;
+						return true;
+					}
+					return false;
+				}
+
+				// throws timeout_error or cancelled_error when halted
+				void check()
+				{
+					if ( halted() )
+					{
+						raise();
+					}
+				}
+
+				// AVERROR_EXIT with a message telling timeouts from cancellation
+				av::status status() const
+				{
+					return av::status( AVERROR_EXIT, reason_ == reason::cancelled ? "operation cancelled" : "operation timed out" );
+				}
+
+				void raise_if_triggered() const
+				{
+					if ( reason_ != reason::none )
+					{
+						raise();
+					}
+				}
+
+				reason why() const
+				{
+					return reason_;
+				}
+
+				AVIOInterruptCB callback()
+				{
+					AVIOInterruptCB result = { &interrupt::poll, this };
+					return result;
+				}
+
+			private:
+
+				interrupt( const interrupt& );
+				interrupt& operator = ( const interrupt& );
+
+				static int poll( void *p )
+				{
+					return static_cast< interrupt* >( p )->triggered();
+				}
+
+				[[noreturn]] void raise() const
+				{
+					std::string what = *phase_name_ ? phase_name_ : "operation";
+					if ( reason_ == reason::cancelled )
+					{
+						throw cancelled_error( what + " cancelled" );
+					}
+					throw timeout_error( what + " timed out" );
+				}
+
+				deadlines deadlines_;
+				clock::time_point total_, phase_;
+				const char *phase_name_;
+				std::atomic< reason > reason_;
+		};
+
+		// reads one packet within the read deadline of i, if any, the deadline only covers
+		// the read itself and is disarmed again before returning
+		inline status read_frame( context &format, packet &p, interrupt *i, const std::nothrow_t& )
+		{
+			if ( !i )
+			{
+				return av::read_frame( format, p, std::nothrow );
+			}
+			if ( i->halted() )
+			{
+				return i->status();
+			}
+			i->arm_read();
+			auto result = av::read_frame( format, p, std::nothrow );
+			i->disarm();
+			if ( !result && !result.eof() && i->why() != interrupt::reason::none )
+			{
+				return i->status();
+			}
+			return result;
+		}
+
+		// false at the end of the file
+		inline bool read_frame( context &format, packet &p, interrupt *i )
+		{
+			auto result = read_frame( format, p, i, std::nothrow );
+			if ( result.eof() )
+			{
+				return false;
+			}
+			if ( !result && i )
+			{
+				i->raise_if_triggered();
+			}
+			result.raise();
+			return true;
+		}
+
+		// lazily decodes the frames of a single stream, packets are only read and
+		// decoded when the next frame is requested, so leaving a loop over the range
+		// early stops all further i/o and decoding
+		// the range refers to the file's context, it must not outlive the file
+		class frame_range
+		{
+			public:
+
+				class iterator : public std::iterator< std::input_iterator_tag, AVFrame >
+				{
+					public:
+
+						iterator( frame_range *range = nullptr ) :
+							range_( range ) {}
+
+						AVFrame& operator *() const
+						{
+							return *range_->frame_;
+						}
+
+						AVFrame* operator ->() const
+						{
+							return range_->frame_.get();
+						}
+
+						iterator& operator ++()
+						{
+							if ( !range_->next() )
+							{
+								range_ = nullptr;
+							}
+							return *this;
+						}
+
+						bool operator == ( const iterator &rhs ) const
+						{
+							return range_ == rhs.range_;
+						}
+
+						bool operator != ( const iterator &rhs ) const
+						{
+							return range_ != rhs.range_;
+						}
+
+					private:
+
+						frame_range *range_;
+				};
+
+				frame_range( context &format, const stream &s, open_timing *timing = nullptr, interrupt *i = nullptr ) :
+					format_( format ),
+					stream_( s ),
+					timing_( timing ),
+					interrupt_( i ),
+					packet_(),
+					frame_( frame::alloc() ),
+					decoded_( frame::alloc() ),
+					pending_(),
+					spare_(),
+					done_( false )
+				{
+					if ( !avcodec_is_open( stream_->codec ) )
+					{
+						stream_.open_input( callback_t() );
+					}
+					stream_->discard = AVDISCARD_DEFAULT;
+				}
+
+				frame_range( frame_range &&rhs ) :
+					format_( rhs.format_ ),
+					stream_( rhs.stream_ ),
+					timing_( rhs.timing_ ),
+					interrupt_( rhs.interrupt_ ),
+					packet_(),
+					frame_( std::move( rhs.frame_ ) ),
+					decoded_( std::move( rhs.decoded_ ) ),
+					pending_( std::move( rhs.pending_ ) ),
+					spare_( std::move( rhs.spare_ ) ),
+					done_( rhs.done_ ) {}
+
+				iterator begin()
+				{
+					return next() ? iterator( this ) : end();
+				}
+
+				iterator end()
+				{
+					return iterator();
+				}
+
+				// decodes the next frame of the stream, returns false when there are no more
+				bool next()
+				{
+					av_frame_unref( frame_.get() );
+
+					// a packet can yield several frames, the ones not handed out yet wait in pending_
+					auto queue = [this]( AVFrame &f )
+					{
+						auto next = spare_.empty() ? frame::alloc() : std::move( spare_.back() );
+						if ( !spare_.empty() )
+						{
+							spare_.pop_back();
+						}
+						av_frame_move_ref( next.get(), &f );
+						pending_.push_back( std::move( next ) );
+					};
+
+					auto &ctx = *stream_->codec;
+					while ( pending_.empty() && !done_ )
+					{
+						if ( !read_frame( format_, packet_, interrupt_ ) )
+						{
+							codec::decode( ctx, nullptr, *decoded_, queue ).value();
+							done_ = true;
+						}
+						else
+						{
+							if ( packet_.stream_index == stream_->index )
+							{
+								codec::decode( ctx, &packet_, *decoded_, queue ).value();
+							}
+							av_packet_unref( &packet_ );
+						}
+					}
+
+					if ( pending_.empty() )
+					{
+						return false;
+					}
+
+					av_frame_move_ref( frame_.get(), pending_.front().get() );
+					spare_.push_back( std::move( pending_.front() ) );
+					pending_.pop_front();
+
+					if ( timing_ && timing_->first_frame == open_timing::clock::duration::zero() )
+					{
+						timing_->first_frame = timing_->elapsed();
+					}
+					return true;
+				}
+
+			private:
+
+				frame_range( const frame_range& );
+				frame_range& operator = ( const frame_range& );
+
+				context &format_;
+				stream stream_;
+				open_timing *timing_;
+				interrupt *interrupt_;
+				packet packet_;
+				frame::frame frame_, decoded_;
+				std::deque< frame::frame > pending_;
+				std::vector< frame::frame > spare_;
+				bool done_;
+		};
+
+		// one packet_queue per stream of a file, all charged to the same budget
+		class packet_queues
+		{
+			public:
+
+				packet_queues( size_t count, const std::shared_ptr< memory_budget > &budget = std::make_shared< memory_budget >(), size_t max_packets = std::numeric_limits< size_t >::max() ) :
+					budget_( budget ),
+					queues_()
+				{
+					for ( auto i = 0u; i < count; ++i )
+					{
+						queues_.emplace_back( new packet_queue( budget_, max_packets ) );
+					}
+				}
+
+				packet_queue& operator []( size_t index )
+				{
+					return *queues_[ index ];
+				}
+
+				size_t size() const
+				{
+					return queues_.size();
+				}
+
+				void close()
+				{
+					for ( auto &q : queues_ )
+					{
+						q->close();
+					}
+				}
+
+				std::vector< packet_queue::occupancy > occupancy() const
+				{
+					std::vector< packet_queue::occupancy > result;
+					for ( auto &q : queues_ )
+					{
+						result.push_back( q->current() );
+					}
+					return result;
+				}
+
+				memory_budget::usage usage() const
+				{
+					return budget_->current();
+				}
+
+			private:
+
+				std::shared_ptr< memory_budget > budget_;
+				std::vector< std::unique_ptr< packet_queue > > queues_;
+		};
+
+		// what a single file holds right now, measured when asked for, including the
+		// payloads of the frames and packets it keeps around
+		struct memory_usage
+		{
+			struct stream_usage
+			{
+				int index;
+				AVMediaType type;
+				size_t codec_context;
+				size_t buffered;
+			};
+
+			size_t format_context;
+			size_t io_context;
+			std::vector< stream_usage > streams;
+
+			size_t total() const
+			{
+				auto result = format_context + io_context;
+				for ( auto &s : streams )
+				{
+					result += s.codec_context + s.buffered;
+				}
+				return result;
+			}
+		};
+
+		// schedules encodes against a target frame rate in wall clock time, frames that
+		// would make the output late are dropped or the previous frame is repeated instead
+		// the counters can be read and the encode stopped from any thread
+		class pacer
+		{
+			public:
+
+				typedef std::chrono::steady_clock clock;
+
+				enum class policy
+				{
+					// leave the missed slots empty, the late frame takes the slot that is due
+					drop,
+					// fill the slots that were missed with the previous frame, keeps a constant frame rate
+					duplicate,
+					// encode every frame, only count the lateness
+					none
+				};
+
+				struct statistics
+				{
+					size_t encoded;
+					// slots left empty
+					size_t dropped;
+					// slots filled with the previous frame
+					size_t duplicated;
+					clock::duration lateness;
+					clock::duration max_lateness;
+				};
+
+				// tolerance is the lateness, in frames, accepted before the policy applies
+				// it is at least one frame, a frame less than an interval late has not missed a slot
+				pacer( AVRational rate, policy p = policy::drop, double tolerance = 1.0 ) :
+					rate_( rate ),
+					policy_( p ),
+					interval_( std::chrono::duration_cast< clock::duration >( std::chrono::duration< double >( av_q2d( av_inv_q( rate ) ) ) ) ),
+					tolerance_( std::chrono::duration_cast< clock::duration >( interval_ * std::max( tolerance, 1.0 ) ) ),
+					stopped_( false ),
+					encoded_( 0 ),
+					dropped_( 0 ),
+					duplicated_( 0 ),
+					lateness_( 0 ),
+					max_lateness_( 0 ) {}
+
+				AVRational rate() const
+				{
+					return rate_;
+				}
+
+				policy on_late() const
+				{
+					return policy_;
+				}
+
+				clock::duration interval() const
+				{
+					return interval_;
+				}
+
+				clock::duration tolerance() const
+				{
+					return tolerance_;
+				}
+
+				// ends the encode after the frame in progress
+				void stop()
+				{
+					stopped_ = true;
+				}
+
+				bool stopped() const
+				{
+					return stopped_;
+				}
+
+				statistics stats() const
+				{
+					statistics result = { encoded_, dropped_, duplicated_, clock::duration( lateness_.load() ), clock::duration( max_lateness_.load() ) };
+					return result;
+				}
+
+			private:
+
+				friend struct file;
+
+				void late( clock::duration d )
+				{
+					lateness_ = d.count();
+					if ( d.count() > max_lateness_ )
+					{
+						max_lateness_ = d.count();
+					}
+				}
+
+				AVRational rate_;
+				policy policy_;
+				clock::duration interval_, tolerance_;
+				std::atomic< bool > stopped_;
+				std::atomic< size_t > encoded_, dropped_, duplicated_;
+				std::atomic< clock::rep > lateness_, max_lateness_;
+		};
+
+		namespace helper
+		{
+			typedef std::vector< std::string > nal_units;
+
+			inline size_t start_code( const uint8_t *p, size_t n, size_t from )
+			{
+				for ( auto i = from; i + 3 <= n; ++i )
+				{
+					if ( !p[ i ] && !p[ i + 1 ] && p[ i + 2 ] == 1 )
+					{
+						return i;
+					}
+				}
+				return n;
+			}
+
+			// splits an Annex B byte stream at its start codes
+			inline nal_units annexb_units( const uint8_t *p, size_t n )
+			{
+				nal_units result;
+				for ( auto s = start_code( p, n, 0 ); s < n; )
+				{
+					auto b = s + 3;
+					s = start_code( p, n, b );
+					// the leading zero of a four byte start code
+					auto e = s;
+					while ( e > b && !p[ e - 1 ] )
+					{
+						--e;
+					}
+					if ( e > b )
+					{
+						result.emplace_back( reinterpret_cast< const char* >( p + b ), e - b );
+					}
+				}
+				return result;
+			}
+
+			// whether the codec can carry parameter sets in its packets, so an encoder whose sets
+			// differ from the source's can still be spliced in
+			inline bool inband_parameter_sets( AVCodecID id )
+			{
+				return id == AV_CODEC_ID_H264 || id == AV_CODEC_ID_HEVC;
+			}
+
+			// the parameter sets of H.264 or HEVC extradata, from an avcC / hvcC record or Annex B
+			// length_size is the size of the length prefix of the packets, 0 for Annex B
+			inline nal_units parameter_sets( AVCodecID id, const uint8_t *p, size_t n, int &length_size )
+			{
+				nal_units result;
+				length_size = 0;
+				auto hevc = id == AV_CODEC_ID_HEVC;
+				if ( n < ( hevc ? 23u : 7u ) || p[ 0 ] != 1 )
+				{
+					for ( auto &u : annexb_units( p, n ) )
+					{
+						auto type = hevc ? ( uint8_t( u[ 0 ] ) >> 1 ) & 0x3f : u[ 0 ] & 0x1f;
+						if ( hevc ? type >= 32 && type <= 34 : type == 7 || type == 8 )
+						{
+							result.push_back( u );
+						}
+					}
+					return result;
+				}
+
+				size_t pos = 0;
+				auto units = [&]( size_t count )
+				{
+					for ( size_t i = 0; i < count; ++i )
+					{
+						if ( pos + 2 > n )
+						{
+							return false;
+						}
+						size_t size = ( p[ pos ] << 8 ) | p[ pos + 1 ];
+						pos += 2;
+						if ( pos + size > n )
+						{
+							return false;
+						}
+						result.emplace_back( reinterpret_cast< const char* >( p + pos ), size );
+						pos += size;
+					}
+					return true;
+				};
+
+				if ( hevc )
+				{
+					// arrays of VPS, SPS, PPS and SEI, each with a type byte and a 16 bit count
+					length_size = ( p[ 21 ] & 3 ) + 1;
+					pos = 23;
+					for ( auto array = 0; array < p[ 22 ]; ++array )
+					{
+						if ( pos + 3 > n )
+						{
+							return nal_units();
+						}
+						size_t count = ( p[ pos + 1 ] << 8 ) | p[ pos + 2 ];
+						pos += 3;
+						if ( !units( count ) )
+						{
+							return nal_units();
+						}
+					}
+					return result;
+				}
+
+				length_size = ( p[ 4 ] & 3 ) + 1;
+				pos = 5;
+				for ( auto set = 0; set < 2; ++set )
+				{
+					if ( pos >= n )
+					{
+						return nal_units();
+					}
+					size_t count = set ? p[ pos ] : p[ pos ] & 0x1f;
+					++pos;
+					if ( !units( count ) )
+					{
+						return nal_units();
+					}
+				}
+				return result;
+			}
+
+			// true when packets of the encoder can be muxed under the parameters of the source
+			// H.264 and HEVC parameter sets are compared whatever form they are stored in,
+			// the extradata of other codecs byte for byte
+			inline bool same_parameter_sets( const AVCodecParameters &source, const AVCodecContext &encoder )
+			{
+				if ( inband_parameter_sets( source.codec_id ) )
+				{
+					int unused;
+					auto a = parameter_sets( source.codec_id, source.extradata, source.extradata_size, unused );
+					auto b = parameter_sets( source.codec_id, encoder.extradata, encoder.extradata_size, unused );
+					return a == b;
+				}
+				return source.extradata_size == encoder.extradata_size
+					&& ( !source.extradata_size || !memcmp( source.extradata, encoder.extradata, source.extradata_size ) );
+			}
+
+			// the sample entry that allows parameter sets in the packets, avc3 or hev1, when the
+			// output format knows it, 0 otherwise
+			inline uint32_t inband_tag( const AVOutputFormat &f, AVCodecID id )
+			{
+				auto tag = id == AV_CODEC_ID_HEVC ? MKTAG( 'h', 'e', 'v', '1' ) : MKTAG( 'a', 'v', 'c', '3' );
+				return f.codec_tag && av_codec_get_id( f.codec_tag, tag ) == id ? tag : 0;
+			}
+
+			// writes a NAL unit behind a big endian length prefix, or a start code when length_size is 0
+			inline uint8_t* put_unit( uint8_t *out, const std::string &u, int length_size )
+			{
+				if ( !length_size )
+				{
+					const uint8_t start[] = { 0, 0, 0, 1 };
+					out = std::copy( start, start + 4, out );
+				}
+				for ( auto i = length_size - 1; i >= 0; --i )
+				{
+					*out++ = uint8_t( u.size() >> ( 8 * i ) );
+				}
+				return std::copy( u.begin(), u.end(), out );
+			}
+
+			inline size_t unit_size( const std::string &u, int length_size )
+			{
+				return ( length_size ? length_size : 4 ) + u.size();
+			}
+
+			// rewrites the start codes of an Annex B packet as big endian length prefixes
+			inline void to_length_prefixed( AVPacket &p, int length_size )
+			{
+				if ( p.size < 4 || p.data[ 0 ] || p.data[ 1 ] || ( p.data[ 2 ] != 1 && ( p.data[ 2 ] || p.data[ 3 ] != 1 ) ) )
+				{
+					return;
+				}
+
+				auto units = annexb_units( p.data, p.size );
+				size_t size = 0;
+				for ( auto &u : units )
+				{
+					size += unit_size( u, length_size );
+				}
+
+				packet result;
+				av_new_packet( &result, int( size ) ) < error( "could not allocate packet" );
+				av_packet_copy_props( &result, &p ) < error( "could not copy packet properties" );
+				auto out = result.data;
+				for ( auto &u : units )
+				{
+					out = put_unit( out, u, length_size );
+				}
+				av_packet_unref( &p );
+				av_packet_move_ref( &p, &result );
+			}
+
+			// puts parameter sets in front of the NAL units of a packet, in the packet's form
+			inline void prepend( AVPacket &p, const nal_units &sets, int length_size )
+			{
+				if ( sets.empty() )
+				{
+					return;
+				}
+
+				size_t size = p.size;
+				for ( auto &u : sets )
+				{
+					size += unit_size( u, length_size );
+				}
+
+				packet result;
+				av_new_packet( &result, int( size ) ) < error( "could not allocate packet" );
+				av_packet_copy_props( &result, &p ) < error( "could not copy packet properties" );
+				auto out = result.data;
+				for ( auto &u : sets )
+				{
+					out = put_unit( out, u, length_size );
+				}
+				std::copy( p.data, p.data + p.size, out );
+				av_packet_unref( &p );
+				av_packet_move_ref( &p, &result );
+			}
+		}
+
+		struct file;
+
+		file open_output( const char *filename );
+
+		struct trim_statistics
+		{
+			// packets written without decoding
+			size_t copied;
+			// video packets produced by re-encoding the partial GOPs at both ends
+			size_t encoded;
+			// the whole cut was re-encoded, because the encoder's parameter sets differ from
+			// the source's and the codec cannot switch them in the stream
+			bool reencoded;
+		};
+
+		struct file
+		{
+			file() :
+				interrupt_(),
+				format_(),
+				streams_(),
+				timing_(),
+				header_written_( false ) {}
+			
+			file( context &&f, const open_timing &t = open_timing(), std::unique_ptr< interrupt > &&i = std::unique_ptr< interrupt >() ) :
+				interrupt_( std::move( i ) ),
+				format_( std::move( f ) ),
+				streams_(),
+				timing_( t ),
+				header_written_( false ) {}
+
+            file( file &&rhs ) :
+				interrupt_( std::move( rhs.interrupt_ ) ),
+				format_( std::move( rhs.format_ ) ),
+				streams_( std::move( rhs.streams_ ) ),
+				timing_( rhs.timing_ ),
+				header_written_( rhs.header_written_ ) {}
+			
+			file& operator = ( file &&rhs )
+			{
+				// the streams refer into the format context, so they go first
+				streams_ = std::move( rhs.streams_ );
+				format_ = std::move( rhs.format_ );
+				interrupt_ = std::move( rhs.interrupt_ );
+				timing_ = rhs.timing_;
+				header_written_ = rhs.header_written_;
+				return *this;
+			}
+			
+			// encodes the next frame of the stream selected by p.stream_index and writes every
+			// packet the encoder produces, returns false once that stream is flushed
+			bool encode( packet &p, AVFrame &frame )
+			{
+				if ( !header_written_ )
+				{
+					write_header();
+				}
+				return av::encode( streams_[ p.stream_index ], p, frame, [this]( AVPacket &out )
+				{
+					av_interleaved_write_frame( format_.get(), &out ) < error( "could not write frame" );
+				} );
+			}
+
+			// called by the first encode, only needed explicitly to pass muxer options
+			void write_header( AVDictionary **options = nullptr )
+			{
+				for ( auto i = 0u; i < format_->nb_streams; ++i )
+				{
+					auto s = format_->streams[ i ];
+					if ( avcodec_is_open( s->codec ) )
+					{
+						avcodec_parameters_from_context( s->codecpar, s->codec ) < error( "could not copy codec parameters" );
+					}
+				}
+				avformat_write_header( format_.get(), options ) < error( "could not write header" );
+				header_written_ = true;
+			}
+
+			// flushes the encoders of all open streams and writes the trailer
+			void finish()
+			{
+				if ( !header_written_ )
+				{
+					write_header();
+				}
+
+				packet p;
+				auto write = [this]( AVPacket &out )
+				{
+					av_interleaved_write_frame( format_.get(), &out ) < error( "could not write frame" );
+				};
+				for ( auto &s : streams_ )
+				{
+					if ( s )
+					{
+						av::encode( s, p, nullptr, write );
+					}
+				}
+
+				av_write_trailer( format_.get() ) < error( "could not write trailer" );
+				if ( format_->pb )
+				{
+					avio_flush( format_->pb );
+				}
+			}
+			
+			inline bool encode( packet &p, frame::frame &frame )
+			{
+				return encode( p, *frame );
+			}
+
+			// encodes a stream in real time at the pacer's rate, until its callback returns false
+			// or the pacer is stopped, and flushes the encoder
+			// frames are stamped with their slot, so dropped slots leave gaps in the timestamps
+			void encode_paced( size_t index, pacer &pace )
+			{
+				if ( !header_written_ )
+				{
+					write_header();
+				}
+
+				auto &s = streams_.at( index );
+				auto &ctx = *s->codec;
+				auto write = [this]( AVPacket &out )
+				{
+					av_interleaved_write_frame( format_.get(), &out ) < error( "could not write frame" );
+				};
+				auto slot_pts = [&]( int64_t n )
+				{
+					return av_rescale_q( n, av_inv_q( pace.rate() ), ctx.time_base );
+				};
+
+				packet p;
+				auto frame = frame::alloc(), previous = frame::alloc();
+				auto start = pacer::clock::now();
+				int64_t n = 0;
+
+				while ( !pace.stopped() )
+				{
+					auto deadline = start + n * pace.interval();
+					std::this_thread::sleep_until( deadline );
+
+					av_frame_unref( frame.get() );
+					if ( !s.call( *frame ) )
+					{
+						break;
+					}
+
+					auto late = std::max( pacer::clock::now() - deadline, pacer::clock::duration::zero() );
+					pace.late( late );
+
+					int64_t missed = late / pace.interval();
+					if ( late > pace.tolerance() )
+					{
+						switch ( pace.on_late() )
+						{
+							case pacer::policy::drop:
+								pace.dropped_ += missed;
+								n += missed;
+								break;
+							case pacer::policy::duplicate:
+								if ( previous->data[ 0 ] )
+								{
+									for ( int64_t i = 0; i < missed; ++i )
+									{
+										previous->pts = slot_pts( n++ );
+										av::encode( s, p, previous.get(), write );
+										++pace.duplicated_;
+									}
+								}
+								break;
+							case pacer::policy::none:
+								break;
+						}
+					}
+
+					frame->pts = slot_pts( n++ );
+					av::encode( s, p, frame.get(), write );
+					++pace.encoded_;
+
+					if ( pace.on_late() == pacer::policy::duplicate )
+					{
+						av_frame_unref( previous.get() );
+						av_frame_ref( previous.get(), frame.get() ) < error( "could not reference frame" );
+					}
+				}
+
+				av::encode( s, p, nullptr, write );
+			}
+
+			void encode_all( packet &&p, frame::frame &&frame )
+			{
+				for ( auto &s : streams_ )
+				{
+					p.stream_index = s->index;
+					
+					while ( encode( p, *frame ) )
+					{
+						//
+					}
+				}
+			}
+
+			// cuts [start, end), in AV_TIME_BASE units, frame accurately into output
+			// everything between the first and the last keyframe inside the cut is stream copied,
+			// only the partial GOPs at both ends are decoded and re-encoded with the codec
+			// parameters of the input, audio and subtitles are copied
+			// the copied packets refer to the parameter sets of the source, when the encoder
+			// produces different ones H.264 and HEVC send both in front of the keyframes at the
+			// joins, as avc3 / hev1 where the output format has them, other codecs re-encode the
+			// whole cut instead
+			// assumes closed GOPs
+			trim_statistics trim( const char *output, int64_t start, int64_t end, const codec::options &o = codec::options() )
+			{
+				const AVRational microseconds = { 1, AV_TIME_BASE };
+				auto ctx = format_.get();
+				auto video = av_find_best_stream( ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0 ) < error( "could not find video stream" );
+				auto vs = ctx->streams[ video ];
+				auto vstart = av_rescale_q( start, microseconds, vs->time_base );
+				auto vend = av_rescale_q( end, microseconds, vs->time_base );
+				auto pts_of = []( const AVPacket &p )
+				{
+					return p.pts != AV_NOPTS_VALUE ? p.pts : p.dts;
+				};
+
+				trim_statistics stats = { 0, 0, false };
+
+				auto out = open_output( output );
+				std::vector< int > map( ctx->nb_streams, -1 );
+				for ( auto i = 0u; i < ctx->nb_streams; ++i )
+				{
+					auto in = ctx->streams[ i ];
+					auto type = in->codecpar->codec_type;
+					if ( type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO && type != AVMEDIA_TYPE_SUBTITLE )
+					{
+						continue;
+					}
+					if ( type == AVMEDIA_TYPE_VIDEO && int( i ) != video )
+					{
+						continue;
+					}
+					auto os = avformat_new_stream( out.ctx(), nullptr ) || error( "could not add stream" );
+					avcodec_parameters_copy( os->codecpar, in->codecpar ) < error( "could not copy codec parameters" );
+					os->codecpar->codec_tag = 0;
+					os->time_base = in->time_base;
+					in->discard = AVDISCARD_DEFAULT;
+					map[ i ] = os->index;
+				}
+
+				// first pass only demuxes, to find the keyframes inside the cut
+				packet p;
+				std::vector< int64_t > keys;
+				av_seek_frame( ctx, video, vstart, AVSEEK_FLAG_BACKWARD ) < error( "could not seek" );
+				while ( read( p ) )
+				{
+					auto ts = pts_of( p );
+					auto key = p.stream_index == video && ( p.flags & AV_PKT_FLAG_KEY );
+					av_packet_unref( &p );
+					if ( key && ts >= vend )
+					{
+						break;
+					}
+					if ( key && ts >= vstart )
+					{
+						keys.push_back( ts );
+					}
+				}
+
+				// a single keyframe in the cut means there is nothing to copy
+				auto k1 = keys.empty() ? vend : keys.front();
+				auto k2 = keys.empty() ? vend : keys.back();
+
+				auto dec = codec::make_context( avcodec_find_decoder( vs->codecpar->codec_id ) || error( "could not find decoder", avcodec_get_name( vs->codecpar->codec_id ) ) );
+				avcodec_parameters_to_context( dec.get(), vs->codecpar ) < error( "could not copy codec parameters" );
+				dec->pkt_timebase = vs->time_base;
+				codec::open_input( *dec );
+
+				auto enc_tb = vs->avg_frame_rate.num && vs->avg_frame_rate.den ? av_inv_q( vs->avg_frame_rate ) : vs->time_base;
+				auto make_encoder = [&]()
+				{
+					auto enc = codec::make_context( avcodec_find_encoder( vs->codecpar->codec_id ) || error( "could not find encoder", avcodec_get_name( vs->codecpar->codec_id ) ) );
+					avcodec_parameters_to_context( enc.get(), vs->codecpar ) < error( "could not copy codec parameters" );
+					av_freep( &enc->extradata );
+					enc->extradata_size = 0;
+					enc->pix_fmt = dec->pix_fmt;
+					enc->time_base = enc_tb;
+					enc->max_b_frames = 0;
+					enc->gop_size = std::numeric_limits< int >::max();
+					if ( out.ctx()->oformat->flags & AVFMT_GLOBALHEADER )
+					{
+						enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+					}
+					codec::open_output( *enc, o );
+					return enc;
+				};
+
+				struct boundary
+				{
+					codec::context encoder;
+					bool started;
+					// the encoder's parameter sets differ from the source's and go in the stream
+					bool inband;
+					// sent in front of its keyframes, empty when the encoder puts them there itself
+					helper::nal_units sets;
+				};
+				boundary head = { make_encoder(), false, false, helper::nal_units() }, tail = { make_encoder(), false, false, helper::nal_units() };
+
+				// packets of an Annex B encoder are rewritten for sources with an avcC or hvcC record
+				auto id = vs->codecpar->codec_id;
+				auto inband = helper::inband_parameter_sets( id );
+				int length_size = 0;
+				helper::nal_units source_sets;
+				if ( inband )
+				{
+					source_sets = helper::parameter_sets( id, vs->codecpar->extradata, vs->codecpar->extradata_size, length_size );
+				}
+
+				auto vout = out.ctx()->streams[ map[ video ] ];
+				for ( auto b : { &head, &tail } )
+				{
+					if ( helper::same_parameter_sets( *vs->codecpar, *b->encoder ) )
+					{
+						continue;
+					}
+					if ( inband )
+					{
+						int unused;
+						b->inband = true;
+						b->sets = helper::parameter_sets( id, b->encoder->extradata, b->encoder->extradata_size, unused );
+						vout->codecpar->codec_tag = helper::inband_tag( *out.ctx()->oformat, id );
+					}
+					else if ( b == &head )
+					{
+						k1 = k2 = vend;
+						stats.reencoded = true;
+						avcodec_parameters_from_context( vout->codecpar, head.encoder.get() ) < error( "could not copy codec parameters" );
+						vout->codecpar->codec_tag = 0;
+						break;
+					}
+					else
+					{
+						error( "could not trim" )( "boundary encoders disagree on parameter sets" );
+					}
+				}
+
+				// the boundaries come from another encoder, so dts are kept increasing across the joins
+				std::vector< int64_t > last_dts( out.ctx()->nb_streams, AV_NOPTS_VALUE );
+				out.write_header();
+
+				auto write = [&]( AVPacket &pk, int index, AVRational from )
+				{
+					auto os = out.ctx()->streams[ map[ index ] ];
+					auto offset = av_rescale_q( start, microseconds, from );
+					if ( pk.pts != AV_NOPTS_VALUE )
+					{
+						pk.pts -= offset;
+					}
+					if ( pk.dts != AV_NOPTS_VALUE )
+					{
+						pk.dts -= offset;
+					}
+					pk.stream_index = os->index;
+					av_packet_rescale_ts( &pk, from, os->time_base );
+
+					auto &last = last_dts[ os->index ];
+					if ( pk.dts != AV_NOPTS_VALUE && last != AV_NOPTS_VALUE && pk.dts <= last )
+					{
+						pk.dts = last + 1;
+						if ( pk.pts != AV_NOPTS_VALUE && pk.pts < pk.dts )
+						{
+							pk.pts = pk.dts;
+						}
+					}
+					last = pk.dts;
+					av_interleaved_write_frame( out.ctx(), &pk ) < error( "could not write frame" );
+				};
+
+				packet encoded;
+				auto encode = [&]( boundary &b, const AVFrame *f )
+				{
+					codec::encode( *b.encoder, f, encoded, [&]( AVPacket &pk )
+					{
+						if ( length_size )
+						{
+							helper::to_length_prefixed( pk, length_size );
+						}
+						if ( pk.flags & AV_PKT_FLAG_KEY )
+						{
+							helper::prepend( pk, b.sets, length_size );
+						}
+						write( pk, video, enc_tb );
+						++stats.encoded;
+					} ).value();
+				};
+
+				// decodes and re-encodes the frames of [lo, hi), a nullptr packet drains the decoder
+				// and flushes the encoder, corrupt packets are skipped
+				auto frame = frame::alloc();
+				auto reencode = [&]( const AVPacket *pk, int64_t lo, int64_t hi, boundary &b )
+				{
+					codec::decode( *dec, pk, *frame, [&]( AVFrame &f )
+					{
+						auto ts = f.best_effort_timestamp;
+						if ( ts < lo || ts >= hi )
+						{
+							return;
+						}
+						f.pict_type = b.started ? AV_PICTURE_TYPE_NONE : AV_PICTURE_TYPE_I;
+						f.pts = av_rescale_q( ts, vs->time_base, enc_tb );
+						b.started = true;
+						encode( b, &f );
+					} ).value();
+					if ( !pk && b.started )
+					{
+						encode( b, nullptr );
+					}
+				};
+
+				enum class phase
+				{
+					head,
+					copy,
+					tail,
+					done
+				};
+
+				auto current = phase::head;
+				auto drain = [&]()
+				{
+					if ( current == phase::head )
+					{
+						reencode( nullptr, vstart, k1, head );
+					}
+					else if ( current == phase::tail )
+					{
+						reencode( nullptr, k2, vend, tail );
+					}
+				};
+				// the other streams are interleaved with the video, so their packets before end
+				// can follow the keyframe that ends the video
+				std::vector< bool > waiting( ctx->nb_streams, false );
+				size_t streams_waiting = 0;
+				for ( auto i = 0u; i < ctx->nb_streams; ++i )
+				{
+					if ( map[ i ] >= 0 && int( i ) != video )
+					{
+						waiting[ i ] = true;
+						++streams_waiting;
+					}
+				}
+
+				av_seek_frame( ctx, video, vstart, AVSEEK_FLAG_BACKWARD ) < error( "could not seek" );
+				while ( ( current != phase::done || streams_waiting ) && read( p ) )
+				{
+					auto index = p.stream_index;
+					if ( index != video )
+					{
+						if ( map[ index ] >= 0 )
+						{
+							auto tb = ctx->streams[ index ]->time_base;
+							auto ts = pts_of( p );
+							if ( ts >= av_rescale_q( start, microseconds, tb ) && ts < av_rescale_q( end, microseconds, tb ) )
+							{
+								write( p, index, tb );
+								++stats.copied;
+							}
+							else if ( waiting[ index ] && ts >= av_rescale_q( end, microseconds, tb ) )
+							{
+								waiting[ index ] = false;
+								--streams_waiting;
+							}
+						}
+						av_packet_unref( &p );
+						continue;
+					}
+
+					auto ts = pts_of( p );
+					if ( p.flags & AV_PKT_FLAG_KEY )
+					{
+						if ( ts >= vend )
+						{
+							drain();
+							current = phase::done;
+						}
+						else if ( current == phase::head && ts == k1 )
+						{
+							drain();
+							current = k1 == k2 ? phase::tail : phase::copy;
+						}
+						else if ( current == phase::copy && ts == k2 )
+						{
+							current = phase::tail;
+						}
+					}
+
+					switch ( current )
+					{
+						case phase::head:
+							reencode( &p, vstart, k1, head );
+							break;
+						case phase::copy:
+							// the head left its own parameter sets active
+							if ( head.inband && ts == k1 )
+							{
+								helper::prepend( p, source_sets, length_size );
+							}
+							write( p, video, vs->time_base );
+							++stats.copied;
+							break;
+						case phase::tail:
+							reencode( &p, k2, vend, tail );
+							break;
+						case phase::done:
+							break;
+					}
+					av_packet_unref( &p );
+				}
+
+				drain();
+				out.finish();
+				return stats;
+			}
+
+			// reads one packet and decodes every frame it yields, at the end of the
+			// file all open streams are flushed and false is returned
+			bool decode( packet &p, AVFrame &frame )
+			{
+				if ( !read( p ) )
+				{
+					flush( frame );
+					return false;
+				}
+
+				auto &s = streams_[ p.stream_index ];
+				if ( s )
+				{
+					av::decode( s, p, frame );
+					if ( timing_.first_frame == open_timing::clock::duration::zero() && s.frames() )
+					{
+						timing_.first_frame = timing_.elapsed();
+					}
+				}
+				av_packet_unref( &p );
+				
+				return true;
+			}
+
+			// drains the frames still buffered in the decoders of all open streams
+			void flush( AVFrame &frame )
+			{
+				const AVPacket nill = { 0 };
+				for ( auto &s : streams_ )
+				{
+					if ( s )
+					{
+						av::decode( s, nill, frame );
+					}
+				}
+			}
+
+			inline bool decode( packet &p, frame::frame &frame )
+			{
+				return decode( p, *frame );
+			}
+
+			void decode_all( packet &&p, frame::frame &&frame )
+			{
+				while ( decode( p, *frame ) )
+				{
+					//
+				}
+			}
+
+			inline void decode_all()
+			{
+				decode_all( av::packet(), av::frame::alloc() );
+			}
+
+			// like decode, but failures are returned instead of thrown
+			// AVERROR_EOF is returned once the file is exhausted and the streams are flushed
+			status decode( packet &p, AVFrame &frame, const std::nothrow_t& )
+			{
+				auto read = format::read_frame( format_, p, interrupt_.get(), std::nothrow );
+				if ( read.eof() )
+				{
+					const AVPacket nill = { 0 };
+					for ( auto &s : streams_ )
+					{
+						if ( s )
+						{
+							auto flushed = av::decode( s, nill, frame, std::nothrow );
+							if ( !flushed )
+							{
+								return flushed.status();
+							}
+						}
+					}
+					return read;
+				}
+
+				if ( !read )
+				{
+					return read;
+				}
+
+				status result;
+				auto &s = streams_[ p.stream_index ];
+				if ( s )
+				{
+					result = av::decode( s, p, frame, std::nothrow ).status();
+					if ( timing_.first_frame == open_timing::clock::duration::zero() && s.frames() )
+					{
+						timing_.first_frame = timing_.elapsed();
+					}
+				}
+				av_packet_unref( &p );
+
+				return result;
+			}
+
+			status decode_all( const std::nothrow_t& )
+			{
+				packet p;
+				auto frame = av::frame::alloc();
+
+				status result;
+				while ( ( result = decode( p, *frame, std::nothrow ) ) )
+				{
+					//
+				}
+
+				return result.eof() ? status() : result;
+			}
+
+			// reads one packet and queues it on its stream, packets of closed streams are dropped
+			// blocks while the queues' budget is exhausted, returns false at the end of the file
+			// the queues are closed at the end of the file and when reading fails, so consumers
+			// blocked in pop never wait forever
+			bool demux( packet_queues &queues, packet &p )
+			{
+				try
+				{
+					if ( !read( p ) )
+					{
+						queues.close();
+						return false;
+					}
+
+					auto index = static_cast< size_t >( p.stream_index );
+					if ( index < queues.size() && format_->streams[ index ]->discard != AVDISCARD_ALL )
+					{
+						queues[ index ].push( packet_move( p ) );
+					}
+					av_packet_unref( &p );
+					return true;
+				}
+				catch( ... )
+				{
+					queues.close();
+					throw;
+				}
+			}
+
+			// pull interface, e.g. for ( AVFrame &f : file.frames( s ) ) { ... }
+			frame_range frames( const stream &s )
+			{
+				return frame_range( format_, s, &timing_, interrupt_.get() );
+			}
+
+			frame_range frames( size_t index )
+			{
+				return frames( streams_.at( index ) );
+			}
+
+			packet_queues make_queues( const std::shared_ptr< memory_budget > &budget = std::make_shared< memory_budget >(), size_t max_packets = std::numeric_limits< size_t >::max() ) const
+			{
+				return packet_queues( streams_.size(), budget, max_packets );
+			}
+
+			// closes the queues on every exit, see demux
+			void demux_all( packet_queues &queues )
+			{
+				packet p;
+				while ( demux( queues, p ) )
+				{
+					//
+				}
+			}
+
+			void add_stream( AVStream *s )
+			{
+				streams_.push_back( stream( s ) );
+			}
+			
+			stream& add_stream( const AVCodec &codec )
+			{
+				streams_.push_back( stream( format_, &codec ) );
+				auto &s = streams_.back();
+				if ( format_->oformat && ( format_->oformat->flags & AVFMT_GLOBALHEADER ) )
+				{
+					s->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+				}
+				return s;
+			}
+			
+			stream& add_stream( AVCodecID codecid )
+			{
+				if ( auto codec = avcodec_find_encoder( codecid ) )
+				{
+					return add_stream( *codec );
+				}
+				error( "could not find codec for id" )( avcodec_get_name( codecid ) );
+			}
+
+			std::vector< stream > streams( AVMediaType filter = AVMEDIA_TYPE_NB ) const
+			{
+				std::vector< stream > result;
+				auto inserter = std::back_insert_iterator< std::vector< stream > >( result );
+				auto s = streams_.begin(), e = streams_.end();
+
+				switch( filter )
+				{
+					case AVMEDIA_TYPE_VIDEO:
+						copy_if< AVMEDIA_TYPE_VIDEO >( s, e, inserter );
+						break;
+					case AVMEDIA_TYPE_AUDIO:
+						copy_if< AVMEDIA_TYPE_AUDIO >( s, e, inserter );
+						break;
+					case AVMEDIA_TYPE_SUBTITLE:
+						copy_if< AVMEDIA_TYPE_SUBTITLE >( s, e, inserter );
+						break;
+					case AVMEDIA_TYPE_UNKNOWN:
+						copy_if< AVMEDIA_TYPE_UNKNOWN >( s, e, inserter );
+						break;
+					case AVMEDIA_TYPE_DATA:
+						copy_if< AVMEDIA_TYPE_DATA >( s, e, inserter );
+						break;
+					case AVMEDIA_TYPE_ATTACHMENT:
+						copy_if< AVMEDIA_TYPE_ATTACHMENT >( s, e, inserter );
+						break;
+					case AVMEDIA_TYPE_NB:
+						result.assign( s, e );
+						break;
+				}
+				return result;
+			}
+			
+			// like streams, without copying them
+			stream_view< stream > view( AVMediaType filter = AVMEDIA_TYPE_NB )
+			{
+				return stream_view< stream >( streams_.data(), streams_.data() + streams_.size(), filter );
+			}
+
+			stream_view< const stream > view( AVMediaType filter = AVMEDIA_TYPE_NB ) const
+			{
+				return stream_view< const stream >( streams_.data(), streams_.data() + streams_.size(), filter );
+			}
+
+			// one independent decoder per stream of the media type, in stream order
+			// each can be moved to its own thread and fed packets read on another
+			std::vector< decode_state > decoders( AVMediaType filter = AVMEDIA_TYPE_NB, int threads = 1 ) const
+			{
+				std::vector< decode_state > result;
+				for ( auto &s : view( filter ) )
+				{
+					if ( s.get() && avcodec_find_decoder( s->codecpar->codec_id ) )
+					{
+						result.emplace_back( *s.get(), threads );
+					}
+				}
+				return result;
+			}
+
+			void find_stream_info( AVDictionary **options = nullptr  )
+			{
+				find_stream_info( options, std::nothrow ).raise();
+			}
+
+			status find_stream_info( AVDictionary **options, const std::nothrow_t& )
+			{
+				status result( avformat_find_stream_info( format_.get(), options ), "could not find stream info" );
+				if ( !result )
+				{
+					return result;
+				}
+				timing_.probed = true;
+				timing_.probe = timing_.elapsed();
+				
+				add_streams();
+
+				return status();
+			}
+
+			// only runs avformat_find_stream_info when a stream the caller wants
+			// is not fully described by the container header
+			void find_stream_info( const probe_options &probe, AVDictionary **options = nullptr )
+			{
+				for ( auto i = 0u; i < format_->nb_streams; ++i )
+				{
+					auto s = format_->streams[ i ];
+					if ( probe.wants( s->codecpar->codec_type ) && !helper::has_parameters( *s->codecpar ) )
+					{
+						find_stream_info( options );
+						return;
+					}
+				}
+
+				for ( auto i = 0u; i < format_->nb_streams; ++i )
+				{
+					auto s = format_->streams[ i ];
+					avcodec_parameters_to_context( s->codec, s->codecpar ) < error( "could not copy codec parameters" );
+					s->codec->pkt_timebase = s->time_base;
+				}
+				timing_.probe = timing_.elapsed();
+
+				add_streams();
+			}
+		
+			// fills the streams from previously probed parameters instead of probing
+			void find_stream_info( const stream_info &info )
+			{
+				if ( !info.matches( *format_ ) )
+				{
+					error( "find stream info" )( "cached stream info does not match input" );
+				}
+
+				format_->start_time = info.start_time;
+				format_->duration = info.duration;
+				format_->bit_rate = info.bit_rate;
+
+				for ( auto i = 0u; i < format_->nb_streams; ++i )
+				{
+					auto s = format_->streams[ i ];
+					auto &e = info.streams[ i ];
+					avcodec_parameters_copy( s->codecpar, e.parameters.get() ) < error( "could not copy codec parameters" );
+					avcodec_parameters_to_context( s->codec, s->codecpar ) < error( "could not copy codec parameters" );
+					// the timestamps below are in the time base the probe settled on
+					if ( e.time_base.num && e.time_base.den )
+					{
+						s->time_base = e.time_base;
+					}
+					s->codec->pkt_timebase = s->time_base;
+					s->avg_frame_rate = e.avg_frame_rate;
+					s->r_frame_rate = e.r_frame_rate;
+					s->start_time = e.start_time;
+					s->duration = e.duration;
+					s->nb_frames = e.nb_frames;
+				}
+				timing_.probe = timing_.elapsed();
+
+				add_streams();
+			}
+
+			AVFormatContext* ctx() const
+			{
+				return format_.get();
+			}
+
+			const open_timing& timing() const
+			{
+				return timing_;
+			}
+
+			// applies deadlines to everything the file does from now on, through libavformat's
+			// interrupt callback and between packets
+			void limit( const deadlines &d )
+			{
+				std::unique_ptr< interrupt > i( new interrupt( d ) );
+				format_->interrupt_callback = i->callback();
+				interrupt_ = std::move( i );
+			}
+
+			// why the last operation was interrupted, tells timeouts from cancellation for
+			// the non-throwing calls that return AVERROR_EXIT
+			interrupt::reason interrupted() const
+			{
+				return interrupt_ ? interrupt_->why() : interrupt::reason::none;
+			}
+
+			memory_usage memory() const
+			{
+				memory_usage result = { 0, 0, std::vector< memory_usage::stream_usage >() };
+				auto ctx = format_.get();
+				if ( !ctx )
+				{
+					return result;
+				}
+
+				result.format_context = sizeof( AVFormatContext );
+				if ( ctx->pb && !( ctx->flags & AVFMT_FLAG_CUSTOM_IO ) )
+				{
+					result.io_context = sizeof( AVIOContext ) + std::max( ctx->pb->buffer_size, 0 );
+				}
+
+				for ( auto i = 0u; i < ctx->nb_streams; ++i )
+				{
+					auto s = ctx->streams[ i ];
+					result.format_context += sizeof( AVStream ) + sizeof( AVCodecParameters ) + std::max( s->codecpar->extradata_size, 0 );
+
+					memory_usage::stream_usage u = { s->index, s->codecpar->codec_type, 0, 0 };
+					if ( s->codec )
+					{
+						u.codec_context = sizeof( AVCodecContext ) + std::max( s->codec->extradata_size, 0 );
+					}
+					if ( i < streams_.size() && streams_[ i ].get() )
+					{
+						u.buffered = streams_[ i ].buffered();
+					}
+					result.streams.push_back( u );
+				}
+
+				return result;
+			}
+
+			private:
+
+                file( const file& );
+
+				void add_streams()
+				{
+					for ( auto i = 0u; i < format_->nb_streams; ++i )
+					{
+						if ( auto s = format_->streams[ i ] )
+						{
+							s->discard = AVDISCARD_ALL;
+							add_stream( s );
+						}
+					}
+				}
+
+				// reads one packet within the read deadline, false at the end of the file
+				bool read( packet &p )
+				{
+					return format::read_frame( format_, p, interrupt_.get() );
+				}
+
+				// outlives the format context that calls it
+				std::unique_ptr< interrupt > interrupt_;
+				context format_;
+				std::vector< stream > streams_;
+				open_timing timing_;
+				bool header_written_;
+		};
+
+		file open_input( const char *filename, context &&p, const probe_options &probe, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			open_timing timing;
+
+			probe.apply( *p );
+
+			// release, instead of get, since avformat_open_input will free ptr on error
+			auto ptr = p.release();
+			avformat_open_input( &ptr, filename, fmt, options ) < error( "open input", filename );
+			p.reset( ptr );
+
+			timing.open = timing.elapsed();
+			
+			file result( std::move( p ), timing );
+			
+			result.find_stream_info( probe, options );
+
+			return result;
+		}
+
+		// reports a missing or unreadable input in the result instead of throwing
+		result< file > open_input( const char *filename, context &&p, const std::nothrow_t&, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			open_timing timing;
+
+			// release, instead of get, since avformat_open_input will free ptr on error
+			auto ptr = p.release();
+			status opened( avformat_open_input( &ptr, filename, fmt, options ), "open input" );
+			if ( !opened )
+			{
+				return opened;
+			}
+			p.reset( ptr );
+
+			timing.open = timing.elapsed();
+
+			file f( std::move( p ), timing );
+
+			auto probed = f.find_stream_info( options, std::nothrow );
+			if ( !probed )
+			{
+				return probed;
+			}
+
+			return std::move( f );
+		}
+
+		result< file > open_input( const char *filename, const std::nothrow_t&, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			auto ptr = avformat_alloc_context();
+			if ( !ptr )
+			{
+				return status( AVERROR( ENOMEM ), "open input" );
+			}
+			return open_input( filename, context( ptr ), std::nothrow, fmt, options );
+		}
+
+		file open_input( const char *filename, context &&p, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			auto result = open_input( filename, std::move( p ), std::nothrow, fmt, options );
+			if ( !result )
+			{
+				error( result.status().message, filename )( result.status().code );
+			}
+			return std::move( *result );
+		}
+
+		// gives up with timeout_error or cancelled_error instead of hanging on a stalled input,
+		// the deadlines stay with the file for reading and decoding
+		file open_input( const char *filename, const deadlines &d, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			open_timing timing;
+
+			std::unique_ptr< interrupt > in( new interrupt( d ) );
+			in->arm_open();
+
+			auto p = make_context();
+			p->interrupt_callback = in->callback();
+
+			auto ptr = p.release();
+			auto opened = avformat_open_input( &ptr, filename, fmt, options );
+			if ( opened < 0 )
+			{
+				in->raise_if_triggered();
+				opened < error( "open input", filename );
+			}
+			p.reset( ptr );
+
+			timing.open = timing.elapsed();
+
+			// owned by the file from here on
+			auto &i = *in;
+			file result( std::move( p ), timing, std::move( in ) );
+
+			auto probed = result.find_stream_info( options, std::nothrow );
+			if ( !probed )
+			{
+				i.raise_if_triggered();
+				probed.raise();
+			}
+			i.disarm();
+
+			return result;
+		}
+
+		inline file open_input( const char *filename, const probe_options &probe, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			return open_input( filename, av::format::make_context(), probe, fmt, options );
+		}
+
+		inline file open_input( const char *filename, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			return open_input( filename, av::format::make_context(), fmt, options );
+		}
+
+		inline file open_input( const char *filename, const io::context::type &ctx, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			return open_input( filename, make_context( ctx ), fmt, options );
+		}
+
+		inline file open_input( const io::context::type &ctx, AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			return open_input( "", make_context( ctx ), fmt, options );
+		}
+		
+		// remembers probed stream parameters, so re-opening the same asset does not
+		// have to decode frames again just to learn its codec parameters
+		// entries are keyed by path, size and modification time, or by a content hash
+		// for inputs that are not files; with a directory they are also stored on disk
+		class stream_info_cache
+		{
+			public:
+
+				typedef std::string key_type;
+
+				explicit stream_info_cache( const std::string &directory = std::string() ) :
+					directory_( directory ),
+					mutex_(),
+					entries_(),
+					hits_( 0 ),
+					misses_( 0 ) {}
+
+				// returns an empty key when the file can not be stat'ed
+				static key_type make_key( const char *filename )
+				{
+					struct stat st;
+					if ( !filename || stat( filename, &st ) != 0 )
+					{
+						return key_type();
+					}
+					using std::to_string;
+					return std::string( filename ) + '|' + to_string( static_cast< long long >( st.st_size ) ) + '|' + to_string( static_cast< long long >( st.st_mtime ) );
+				}
+
+				static key_type make_key( const uint8_t *data, size_t size )
+				{
+					using std::to_string;
+					return "content|" + to_string( static_cast< unsigned long long >( size ) ) + '|' + to_string( static_cast< unsigned long long >( hash( data, size ) ) );
+				}
+
+				std::shared_ptr< const stream_info > find( const key_type &key )
+				{
+					if ( key.empty() )
+					{
+						return nullptr;
+					}
+
+					{
+						std::lock_guard< std::mutex > lock( mutex_ );
+						auto i = entries_.find( key );
+						if ( i != entries_.end() )
+						{
+							++hits_;
+							return i->second;
+						}
+					}
+
+					if ( auto info = load( key ) )
+					{
+						std::lock_guard< std::mutex > lock( mutex_ );
+						++hits_;
+						return entries_.insert( std::make_pair( key, info ) ).first->second;
+					}
+
+					std::lock_guard< std::mutex > lock( mutex_ );
+					++misses_;
+					return nullptr;
+				}
+
+				void insert( const key_type &key, stream_info &&info )
+				{
+					if ( key.empty() )
+					{
+						return;
+					}
+
+					auto shared = std::make_shared< const stream_info >( std::move( info ) );
+
+					store( key, *shared );
+
+					std::lock_guard< std::mutex > lock( mutex_ );
+					entries_[ key ] = shared;
+				}
+
+				void erase( const key_type &key )
+				{
+					std::lock_guard< std::mutex > lock( mutex_ );
+					entries_.erase( key );
+					if ( !directory_.empty() )
+					{
+						std::remove( path( key ).c_str() );
+					}
+				}
+
+				void clear()
+				{
+					std::lock_guard< std::mutex > lock( mutex_ );
+					entries_.clear();
+				}
+
+				size_t size() const
+				{
+					std::lock_guard< std::mutex > lock( mutex_ );
+					return entries_.size();
+				}
+
+				size_t hits() const
+				{
+					std::lock_guard< std::mutex > lock( mutex_ );
+					return hits_;
+				}
+
+				size_t misses() const
+				{
+					std::lock_guard< std::mutex > lock( mutex_ );
+					return misses_;
+				}
+
+			private:
+
+				stream_info_cache( const stream_info_cache& );
+				stream_info_cache& operator = ( const stream_info_cache& );
+
+				// 64 bit FNV-1a
+				static uint64_t hash( const uint8_t *data, size_t size )
+				{
+					uint64_t result = 14695981039346656037ULL;
+					for ( auto end = data + size; data != end; ++data )
+					{
+						result ^= *data;
+						result *= 1099511628211ULL;
+					}
+					return result;
+				}
+
+				std::string path( const key_type &key ) const
+				{
+					char name[ 17 ];
+					snprintf( name, sizeof( name ), "%016llx", static_cast< unsigned long long >( hash( reinterpret_cast< const uint8_t* >( key.data() ), key.size() ) ) );
+					return directory_ + '/' + name + ".streaminfo";
+				}
+
+				static const char* magic()
+				{
+					return "ffmpeg++ streaminfo 1";
+				}
+
+				template < typename T >
+				static void write( std::ostream &out, T value )
+				{
+					auto v = static_cast< int64_t >( value );
+					out.write( reinterpret_cast< const char* >( &v ), sizeof( v ) );
+				}
+
+				template < typename T >
+				static void read( std::istream &in, T &value )
+				{
+					int64_t v = 0;
+					in.read( reinterpret_cast< char* >( &v ), sizeof( v ) );
+					value = static_cast< T >( v );
+				}
+
+				template < typename Stream, typename Parameters, typename Function >
+				static void visit_parameters( Stream &s, Parameters &p, Function f )
+				{
+					f( s, p.codec_type ); f( s, p.codec_id ); f( s, p.codec_tag ); f( s, p.format );
+					f( s, p.bit_rate ); f( s, p.bits_per_coded_sample ); f( s, p.bits_per_raw_sample );
+					f( s, p.profile ); f( s, p.level ); f( s, p.width ); f( s, p.height );
+					f( s, p.sample_aspect_ratio.num ); f( s, p.sample_aspect_ratio.den );
+					f( s, p.field_order ); f( s, p.color_range ); f( s, p.color_primaries ); f( s, p.color_trc );
+					f( s, p.color_space ); f( s, p.chroma_location ); f( s, p.video_delay );
+					f( s, p.channel_layout ); f( s, p.channels ); f( s, p.sample_rate ); f( s, p.block_align );
+					f( s, p.frame_size ); f( s, p.initial_padding ); f( s, p.trailing_padding ); f( s, p.seek_preroll );
+				}
+
+				template < typename Stream, typename Entry, typename Function >
+				static void visit_entry( Stream &s, Entry &e, Function f )
+				{
+					f( s, e.time_base.num ); f( s, e.time_base.den );
+					f( s, e.avg_frame_rate.num ); f( s, e.avg_frame_rate.den );
+					f( s, e.r_frame_rate.num ); f( s, e.r_frame_rate.den );
+					f( s, e.start_time ); f( s, e.duration ); f( s, e.nb_frames );
+				}
+
+				struct writer
+				{
+					template < typename T >
+					void operator()( std::ostream &out, const T &value ) const
+					{
+						write( out, value );
+					}
+				};
+
+				struct reader
+				{
+					template < typename T >
+					void operator()( std::istream &in, T &value ) const
+					{
+						read( in, value );
+					}
+				};
+
+				// a name no other thread or process storing the same key uses at the same time
+				static std::string temporary( const std::string &target )
+				{
+					using std::to_string;
+					static std::atomic< unsigned long long > counter( 0 );
+#if defined( _WIN32 )
+					auto pid = static_cast< long long >( _getpid() );
+#else
+					auto pid = static_cast< long long >( getpid() );
+#endif
+					auto thread = static_cast< unsigned long long >( std::hash< std::thread::id >()( std::this_thread::get_id() ) );
+					return target + ".tmp." + to_string( pid ) + '.' + to_string( thread ) + '.' + to_string( counter++ );
+				}
+
+				void store( const key_type &key, const stream_info &info ) const
+				{
+					if ( directory_.empty() )
+					{
+						return;
+					}
+
+					// write to a temporary first, so concurrent readers never see a partial file
+					auto target = path( key ), tmp = temporary( target );
+					{
+						std::ofstream out( tmp, std::ios::binary );
+						out << magic() << '\n' << key << '\n';
+						write( out, info.start_time );
+						write( out, info.duration );
+						write( out, info.bit_rate );
+						write( out, info.streams.size() );
+						for ( auto &e : info.streams )
+						{
+							auto &p = *e.parameters;
+							visit_parameters( out, p, writer() );
+							visit_entry( out, e, writer() );
+							write( out, p.extradata_size );
+							out.write( reinterpret_cast< const char* >( p.extradata ), p.extradata_size );
+						}
+						if ( !out )
+						{
+							std::remove( tmp.c_str() );
+							return;
+						}
+					}
+					std::rename( tmp.c_str(), target.c_str() );
+				}
+
+				std::shared_ptr< const stream_info > load( const key_type &key ) const
+				{
+					if ( directory_.empty() )
+					{
+						return nullptr;
+					}
+
+					std::ifstream in( path( key ), std::ios::binary );
+					std::string m, k;
+					if ( !std::getline( in, m ) || m != magic() || !std::getline( in, k ) || k != key )
+					{
+						return nullptr;
+					}
+
+					stream_info info;
+					size_t count = 0;
+					read( in, info.start_time );
+					read( in, info.duration );
+					read( in, info.bit_rate );
+					read( in, count );
+					if ( !in || count > 4096 )
+					{
+						return nullptr;
+					}
+
+					info.streams.resize( count );
+					for ( auto &e : info.streams )
+					{
+						auto &p = *e.parameters;
+						visit_parameters( in, p, reader() );
+						visit_entry( in, e, reader() );
+						int size = 0;
+						read( in, size );
+						if ( !in || size < 0 || size > ( 1 << 24 ) )
+						{
+							return nullptr;
+						}
+						if ( size )
+						{
+							p.extradata = reinterpret_cast< uint8_t* >( av_mallocz( size + AV_INPUT_BUFFER_PADDING_SIZE ) ) || error( "could not allocate extradata" );
+							p.extradata_size = size;
+							in.read( reinterpret_cast< char* >( p.extradata ), size );
+						}
+					}
+
+					if ( !in )
+					{
+						return nullptr;
+					}
+
+					return std::make_shared< const stream_info >( std::move( info ) );
+				}
+
+				std::string directory_;
+				mutable std::mutex mutex_;
+				std::map< key_type, std::shared_ptr< const stream_info > > entries_;
+				size_t hits_, misses_;
+		};
+
+		file open_input( const char *filename, context &&p, stream_info_cache &cache, const stream_info_cache::key_type &key, const probe_options &probe = probe_options(), AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			open_timing timing;
+
+			probe.apply( *p );
+
+			// release, instead of get, since avformat_open_input will free ptr on error
+			auto ptr = p.release();
+			avformat_open_input( &ptr, filename, fmt, options ) < error( "open input", filename );
+			p.reset( ptr );
+
+			timing.open = timing.elapsed();
+
+			file result( std::move( p ), timing );
+
+			auto info = cache.find( key );
+			if ( info && info->matches( *result.ctx() ) )
+			{
+				result.find_stream_info( *info );
+			}
+			else
+			{
+				result.find_stream_info( probe, options );
+				cache.insert( key, stream_info::from( *result.ctx() ) );
+			}
+
+			return result;
+		}
+
+		inline file open_input( const char *filename, stream_info_cache &cache, const probe_options &probe = probe_options(), AVInputFormat *fmt = nullptr, AVDictionary **options = nullptr )
+		{
+			return open_input( filename, av::format::make_context(), cache, stream_info_cache::make_key( filename ), probe, fmt, options );
+		}
+
+		file open_output( const char *filename )
+		{
+			AVFormatContext *ctx = nullptr;
+			avformat_alloc_output_context2( &ctx, nullptr, nullptr, filename ) < error( "could not open output format" );
+			context result( ctx );
+			
+			if ( !( ctx->oformat->flags & AVFMT_NOFILE ) )
+			{
+				avio_open( &ctx->pb, filename, AVIO_FLAG_WRITE ) < error( "could not open output file" );
+			}
+
+			return file( std::move( result ) );
+		}
+
+		// muxes into memory instead of a file, format_name selects the muxer, e.g. "mjpeg"
+		// out has to outlive the returned file
+		file open_output( io::memory_output &out, const char *format_name )
+		{
+			AVFormatContext *ctx = nullptr;
+			avformat_alloc_output_context2( &ctx, nullptr, format_name, nullptr ) < error( "could not open output format", format_name );
+
+			ctx->pb = out.context().get();
+			ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+			return file( context( ctx ) );
+		}
+	}
+}
+
+namespace sws
+{
+	// a set of cached scaler contexts, each slot is only recreated when its parameters change
+	class context
+	{
+		public:
+
+			context() :
+				contexts_() {}
+
+			~context()
+			{
+				for ( auto c : contexts_ )
+				{
+					sws_freeContext( c );
+				}
+			}
+
+			SwsContext* get( size_t slot, int src_width, int src_height, AVPixelFormat src_format, int dst_width, int dst_height, AVPixelFormat dst_format, int flags )
+			{
+				if ( slot >= contexts_.size() )
+				{
+					contexts_.resize( slot + 1, nullptr );
+				}
+				auto &c = contexts_[ slot ];
+				c = sws_getCachedContext( c, src_width, src_height, src_format, dst_width, dst_height, dst_format, flags, nullptr, nullptr, nullptr ) || av::error( "could not create scaler" );
+				return c;
+			}
+
+		private:
+
+			context( const context& );
+			context& operator = ( const context& );
+
+		std::vector< SwsContext* > contexts_;
+    };
+
+    template < typename T >
+    struct array_helper : std::array< T, AV_NUM_DATA_POINTERS >
+    {
+        typedef std::array< T, AV_NUM_DATA_POINTERS > base;
+		
+		template < typename Iterator >
+		array_helper( Iterator a, Iterator b ) :
+			base()
+		{
+			auto count = std::min< size_t >( std::distance( a, b ), AV_NUM_DATA_POINTERS );
+			std::copy( a, a + count, base::begin() );
+			std::fill( base::begin() + count, base::end(), T() );
+		}
+
+        array_helper( T v = T() ) :
+            base()
+        {
+            base::operator []( 0 ) = v;
+            std::fill( base::begin() + 1, base::end(), T() );
+        }
+
+        array_helper( T a, T b ) :
+            base()
+        {
+            base::operator []( 0 ) = a;
+            base::operator []( 1 ) = b;
+            std::fill( base::begin() + 2, base::end(), T() );
+        }
+
+        array_helper( T a, T b, T c ) :
+            base()
+        {
+            base::operator []( 0 ) = a;
+            base::operator []( 1 ) = b;
+            base::operator []( 2 ) = c;
+            std::fill( base::begin() + 3, base::end(), T() );
+        }
+
+        array_helper( T a, T b, T c, T d ) :
+            base()
+        {
+            base::operator []( 0 ) = a;
+            base::operator []( 1 ) = b;
+            base::operator []( 2 ) = c;
+            base::operator []( 3 ) = d;
+            std::fill( base::begin() + 4, base::end(), T() );
+        }
+    };
+
+    typedef array_helper< int > strides_t;
+    typedef array_helper< uint8_t* > pointers_t;
+	
+	template < typename Destination, typename Source >
+	void assign_if_null( Destination &dest, const Source &src )
+	{
+		if ( !dest )
+		{
+			dest = src;
+		}
+	}
+	
+	struct helper
+	{
+		void to_avframe( AVFrame &f ) const
+		{
+			std::copy( stride.begin(), stride.end(), f.linesize );
+			std::copy( data.begin(), data.end(), f.data );
+			f.format = format;
+			f.width = width;
+			f.height = height;
+		}
+		void to_avframe( av::frame::frame &f ) const
+		{
+			to_avframe( *f );
+		}
+		av::frame::frame to_avframe() const
+		{
+			auto f = av::frame::alloc();
+			to_avframe( f );
+			return f;
+		}
+		strides_t stride;
+		pointers_t data;
+		AVPixelFormat format;
+		size_t width, height;
+	};
+
+	namespace pixel
+	{
+		constexpr int align( int n, int a )
+		{
+			return ( n + a - 1 ) / a * a;
+		}
+
+		// plane layout of a pixel format, chroma subsampling is given as log2 and bytes are
+		// per pixel of a plane, so packed formats are a single plane of several bytes
+		template < int Planes, int ChromaW, int ChromaH, int LumaBytes, int ChromaBytes = LumaBytes >
+		struct layout
+		{
+			static constexpr int planes()
+			{
+				return Planes;
+			}
+
+			static constexpr int chroma_w()
+			{
+				return ChromaW;
+			}
+
+			static constexpr int chroma_h()
+			{
+				return ChromaH;
+			}
+
+			// the alpha plane is not subsampled
+			static constexpr bool chroma( int plane )
+			{
+				return Planes > 1 && ( plane == 1 || plane == 2 );
+			}
+
+			static constexpr int bytes( int plane )
+			{
+				return chroma( plane ) ? ChromaBytes : LumaBytes;
+			}
+
+			// rounded up, odd sizes keep their last chroma sample
+			static constexpr int width( int plane, int w )
+			{
+				return chroma( plane ) ? ( w + ( 1 << ChromaW ) - 1 ) >> ChromaW : w;
+			}
+
+			static constexpr int height( int plane, int h )
+			{
+				return chroma( plane ) ? ( h + ( 1 << ChromaH ) - 1 ) >> ChromaH : h;
+			}
+
+			// bytes of pixel data in a row, without padding
+			static constexpr int row( int plane, int w )
+			{
+				return width( plane, w ) * bytes( plane );
+			}
+		};
+
+		// only the formats listed here can be used with view and image
+		template < AVPixelFormat F >
+		struct traits;
+
+		template <> struct traits< AV_PIX_FMT_YUV420P > : layout< 3, 1, 1, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUVJ420P > : layout< 3, 1, 1, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUV422P > : layout< 3, 1, 0, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUVJ422P > : layout< 3, 1, 0, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUV440P > : layout< 3, 0, 1, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUVJ440P > : layout< 3, 0, 1, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUV444P > : layout< 3, 0, 0, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUVJ444P > : layout< 3, 0, 0, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUV411P > : layout< 3, 2, 0, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUV410P > : layout< 3, 2, 2, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUVA420P > : layout< 4, 1, 1, 1 > {};
+		template <> struct traits< AV_PIX_FMT_NV12 > : layout< 2, 1, 1, 1, 2 > {};
+		template <> struct traits< AV_PIX_FMT_NV21 > : layout< 2, 1, 1, 1, 2 > {};
+		template <> struct traits< AV_PIX_FMT_GRAY8 > : layout< 1, 0, 0, 1 > {};
+		template <> struct traits< AV_PIX_FMT_YUYV422 > : layout< 1, 0, 0, 2 > {};
+		template <> struct traits< AV_PIX_FMT_RGB24 > : layout< 1, 0, 0, 3 > {};
+		template <> struct traits< AV_PIX_FMT_BGR24 > : layout< 1, 0, 0, 3 > {};
+		template <> struct traits< AV_PIX_FMT_RGBA > : layout< 1, 0, 0, 4 > {};
+		template <> struct traits< AV_PIX_FMT_BGRA > : layout< 1, 0, 0, 4 > {};
+		template <> struct traits< AV_PIX_FMT_ARGB > : layout< 1, 0, 0, 4 > {};
+		template <> struct traits< AV_PIX_FMT_ABGR > : layout< 1, 0, 0, 4 > {};
+
+		// rows padded to a multiple of Align, so every row of every plane starts aligned
+		template < AVPixelFormat F, int Align >
+		constexpr int stride( int plane, int w )
+		{
+			return align( traits< F >::row( plane, w ), Align );
+		}
+
+		// bytes of the planes from plane onwards, laid out back to back
+		template < AVPixelFormat F, int Align >
+		constexpr size_t size( int w, int h, int plane = 0 )
+		{
+			return plane >= traits< F >::planes() ? 0 : size_t( stride< F, Align >( plane, w ) ) * traits< F >::height( plane, h ) + size< F, Align >( w, h, plane + 1 );
+		}
+	}
+
+	// non-owning view of the planes of an image in format F
+	template < AVPixelFormat F >
+	class view
+	{
+		public:
+
+			typedef pixel::traits< F > traits;
+
+			view() :
+				data_(),
+				stride_(),
+				width_( 0 ),
+				height_( 0 ) {}
+
+			view( const pointers_t &data, const strides_t &stride, int width, int height ) :
+				data_( data ),
+				stride_( stride ),
+				width_( width ),
+				height_( height ) {}
+
+			// the frame has to be in format F
+			explicit view( const AVFrame &f ) :
+				data_( f.data, f.data + AV_NUM_DATA_POINTERS ),
+				stride_( f.linesize, f.linesize + AV_NUM_DATA_POINTERS ),
+				width_( f.width ),
+				height_( f.height )
+			{
+				if ( f.format != F )
+				{
+					av::error( "could not view frame", av_get_pix_fmt_name( F ) )( "frame has a different pixel format" );
+				}
+			}
+
+			static constexpr AVPixelFormat format()
+			{
+				return F;
+			}
+
+			int width() const
+			{
+				return width_;
+			}
+
+			int height() const
+			{
+				return height_;
+			}
+
+			int width( int plane ) const
+			{
+				return traits::width( plane, width_ );
+			}
+
+			int height( int plane ) const
+			{
+				return traits::height( plane, height_ );
+			}
+
+			uint8_t* plane( int p ) const
+			{
+				return data_[ p ];
+			}
+
+			int stride( int p ) const
+			{
+				return stride_[ p ];
+			}
+
+			uint8_t* row( int p, int y ) const
+			{
+				return data_[ p ] + ptrdiff_t( y ) * stride_[ p ];
+			}
+
+			sws::helper helper() const
+			{
+				sws::helper h;
+				h.data = data_;
+				h.stride = stride_;
+				h.format = F;
+				h.width = width_;
+				h.height = height_;
+				return h;
+			}
+
+			// the frame refers to the planes of the view and does not own them
+			void to_avframe( AVFrame &f ) const
+			{
+				helper().to_avframe( f );
+			}
+
+		private:
+
+			pointers_t data_;
+			strides_t stride_;
+			int width_, height_;
+	};
+
+	// an image in format F owning a single allocation, every plane and row starts on an
+	// Align boundary and rows are padded to a multiple of it, so whole vectors can be
+	// loaded and stored up to the stride
+	template < AVPixelFormat F, int Align = 64 >
+	class image : public view< F >
+	{
+		static_assert( Align > 0 && ( Align & ( Align - 1 ) ) == 0, "alignment has to be a power of two" );
+
+		public:
+
+			typedef pixel::traits< F > traits;
+
+			image( int width, int height ) :
+				view< F >(),
+				buffer_( pixel::size< F, Align >( width, height ) + Align + AV_INPUT_BUFFER_PADDING_SIZE )
+			{
+				auto base = buffer_.data() || av::error( "could not allocate image" );
+				base += ( Align - reinterpret_cast< uintptr_t >( base ) % Align ) % Align;
+
+				pointers_t data;
+				strides_t stride;
+				for ( int p = 0; p < traits::planes(); ++p )
+				{
+					data[ p ] = base;
+					stride[ p ] = pixel::stride< F, Align >( p, width );
+					base += size_t( stride[ p ] ) * traits::height( p, height );
+				}
+				view< F >::operator = ( view< F >( data, stride, width, height ) );
+			}
+
+			static constexpr int alignment()
+			{
+				return Align;
+			}
+
+		private:
+
+			av::buffer buffer_;
+	};
+
+    void convert( const helper &src, helper &dst, int flags = 0 )
+	{
+		auto ctx = sws_getCachedContext( nullptr, src.width, src.height, src.format, dst.width, dst.height, dst.format, flags, nullptr, nullptr, nullptr );
+		
+        sws_scale( ctx, src.data.data(), src.stride.data(), 0, src.height, dst.data.data(), dst.stride.data() );
+		
+		sws_freeContext( ctx );
+	}
+
+	template < AVPixelFormat S, AVPixelFormat D >
+	void convert( const view< S > &src, const view< D > &dst, int flags = 0 )
+	{
+		auto d = dst.helper();
+		convert( src.helper(), d, flags );
+	}
+
+    void convert( AVFrame &frame, const pointers_t &dst, const strides_t &strides, AVPixelFormat desired, size_t width = 0, size_t height = 0, int flags = 0 )
+	{
+		assign_if_null( width, frame.width );
+		assign_if_null( height, frame.height );
+
+		auto ctx = sws_getCachedContext( nullptr, frame.width, frame.height, static_cast< AVPixelFormat >( frame.format ), width, height, desired, flags, nullptr, nullptr, nullptr );
+
+		auto &picture = reinterpret_cast< AVPicture& >( frame );
+        sws_scale( ctx, picture.data, picture.linesize, 0, frame.height, dst.data(), strides.data() );
+	}
+
+	void convert( AVFrame &frame, void *dst, int stride, AVPixelFormat desired, size_t width = 0, size_t height = 0, int flags = 0 )
+	{
+        convert( frame, pointers_t( reinterpret_cast< uint8_t* >( dst ) ), strides_t( stride ), desired, width, height, flags );
+	}
+
+	struct rung
+	{
+		size_t width, height;
+		AVPixelFormat format;
+		int flags;
+	};
+
+	// scales one frame to several sizes and formats in a single plan, the smaller
+	// rungs are scaled from the already scaled larger ones when quality allows, so
+	// a whole ladder costs about as much as its largest rung
+	// output frames come from per rung buffer pools and may be kept by the caller
+	class ladder
+	{
+		public:
+
+			struct step
+			{
+				size_t rung;
+				// index of the rung scaled from, -1 for the source frame
+				int source;
+				// source and rung are identical, the output is a reference
+				bool reference;
+			};
+
+			// headroom is how much larger an intermediate has to be than the rung it feeds
+			explicit ladder( double headroom = 1.0 ) :
+				headroom_( headroom ),
+				rungs_(),
+				plan_(),
+				source_(),
+				contexts_(),
+				pools_() {}
+
+			// returns the index of the rung in the result of scale
+			size_t add( size_t width, size_t height, AVPixelFormat format, int flags = SWS_BICUBIC )
+			{
+				rung r = { width, height, format, flags };
+				rungs_.push_back( r );
+				plan_.clear();
+				return rungs_.size() - 1;
+			}
+
+			// one frame per rung, in the order they were added
+			std::vector< av::frame::frame > scale( const AVFrame &src )
+			{
+				rung source = { static_cast< size_t >( src.width ), static_cast< size_t >( src.height ), static_cast< AVPixelFormat >( src.format ), 0 };
+				if ( plan_.empty() || !same( source, source_ ) )
+				{
+					make_plan( source );
+				}
+
+				std::vector< av::frame::frame > result( rungs_.size() );
+				for ( auto &s : plan_ )
+				{
+					const AVFrame &in = s.source < 0 ? src : *result[ s.source ];
+					if ( s.reference )
+					{
+						result[ s.rung ] = av::frame::ref( in );
+						continue;
+					}
+
+					auto &r = rungs_[ s.rung ];
+					auto out = alloc( s.rung );
+					av_frame_copy_props( out.get(), &in );
+
+					auto ctx = contexts_.get( s.rung, in.width, in.height, static_cast< AVPixelFormat >( in.format ), r.width, r.height, r.format, r.flags );
+					sws_scale( ctx, in.data, in.linesize, 0, in.height, out->data, out->linesize );
+
+					result[ s.rung ] = std::move( out );
+				}
+				return result;
+			}
+
+			// the steps of the last plan, in execution order
+			const std::vector< step >& plan() const
+			{
+				return plan_;
+			}
+
+		private:
+
+			ladder( const ladder& );
+			ladder& operator = ( const ladder& );
+
+			typedef std::unique_ptr< AVBufferPool, void(*)( AVBufferPool* ) > pool_type;
+
+			// true when scaling from an already scaled image loses nothing compared to scaling
+			// from the original: it is large enough and has at least the chroma resolution and
+			// bit depth of the target
+			static bool can_feed( const rung &from, const rung &to, double headroom )
+			{
+				auto f = av_pix_fmt_desc_get( from.format ), t = av_pix_fmt_desc_get( to.format );
+				if ( !f || !t )
+				{
+					return false;
+				}
+				return from.width >= to.width * headroom && from.height >= to.height * headroom
+					&& f->log2_chroma_w <= t->log2_chroma_w && f->log2_chroma_h <= t->log2_chroma_h
+					&& f->comp[ 0 ].depth >= t->comp[ 0 ].depth
+					&& ( f->flags & AV_PIX_FMT_FLAG_RGB ) == ( t->flags & AV_PIX_FMT_FLAG_RGB );
+			}
+
+			static bool same( const rung &a, const rung &b )
+			{
+				return a.width == b.width && a.height == b.height && a.format == b.format;
+			}
+
+			static void pool_free( AVBufferPool *p )
+			{
+				av_buffer_pool_uninit( &p );
+			}
+
+			void make_plan( const rung &source )
+			{
+				source_ = source;
+				plan_.clear();
+
+				std::vector< size_t > order( rungs_.size() );
+				for ( auto i = 0u; i < order.size(); ++i )
+				{
+					order[ i ] = i;
+				}
+				std::stable_sort( order.begin(), order.end(), [this]( size_t a, size_t b )
+				{
+					return rungs_[ a ].width * rungs_[ a ].height > rungs_[ b ].width * rungs_[ b ].height;
+				} );
+
+				for ( auto i : order )
+				{
+					auto &r = rungs_[ i ];
+					step s = { i, -1, same( source, r ) };
+
+					// pick the smallest already planned rung that can feed this one
+					auto best = source.width * source.height;
+					for ( auto &done : plan_ )
+					{
+						if ( s.reference )
+						{
+							break;
+						}
+						auto &candidate = rungs_[ done.rung ];
+						auto area = candidate.width * candidate.height;
+						if ( same( candidate, r ) )
+						{
+							s.source = static_cast< int >( done.rung );
+							s.reference = true;
+						}
+						else if ( area < best && can_feed( candidate, r, headroom_ ) )
+						{
+							s.source = static_cast< int >( done.rung );
+							best = area;
+						}
+					}
+					plan_.push_back( s );
+				}
+
+				pools_.clear();
+				for ( auto &r : rungs_ )
+				{
+					auto size = av_image_get_buffer_size( r.format, r.width, r.height, 32 ) < av::error( "could not get image size" );
+					pools_.push_back( pool_type( av_buffer_pool_init( size, &av_buffer_alloc ) || av::error( "could not create buffer pool" ), &pool_free ) );
+				}
+			}
+
+			av::frame::frame alloc( size_t index )
+			{
+				auto &r = rungs_[ index ];
+				auto f = av::frame::alloc();
+				f->format = r.format;
+				f->width = r.width;
+				f->height = r.height;
+				f->buf[ 0 ] = av_buffer_pool_get( pools_[ index ].get() ) || av::error( "could not allocate frame" );
+				av_image_fill_arrays( f->data, f->linesize, f->buf[ 0 ]->data, r.format, r.width, r.height, 32 ) < av::error( "could not fill frame" );
+				return f;
+			}
+
+			double headroom_;
+			std::vector< rung > rungs_;
+			std::vector< step > plan_;
+			rung source_;
+			context contexts_;
+			std::vector< pool_type > pools_;
+	};
+}
+
+namespace av
+{
+	// one decode feeding several encoders, e.g. the renditions of an ABR ladder
+	// every decoded frame is scaled once through an sws::ladder, renditions that
+	// match the source or each other share frames by reference count, and every
+	// rendition encodes on its own thread
+	class fanout
+	{
+		public:
+
+			struct rendition
+			{
+				rendition( const std::string &f, int w, int h, int64_t b, AVCodecID c = AV_CODEC_ID_H264 ) :
+					filename( f ),
+					codec( c ),
+					width( w ),
+					height( h ),
+					bit_rate( b ),
+					pix_fmt( AV_PIX_FMT_NONE ),
+					gop_size( 0 ),
+					sws_flags( SWS_BICUBIC ),
+					encoder() {}
+
+				std::string filename;
+				AVCodecID codec;
+				int width, height;
+				int64_t bit_rate;
+				// AV_PIX_FMT_NONE picks the first format the encoder supports
+				AVPixelFormat pix_fmt;
+				// 0 keeps the encoder default
+				int gop_size;
+				int sws_flags;
+				// threading, preset and private options of the encoder
+				codec::options encoder;
+			};
+
+			struct statistics
+			{
+				std::string filename;
+				size_t frames;
+				bounded_queue< frame::frame >::occupancy queue;
+				// encoder options that were not recognized
+				std::vector< std::string > rejected;
+			};
+
+			// every rendition buffers at most queue_frames decoded frames before
+			// it back-pressures the decoder
+			fanout( format::file &input, const stream &source, size_t queue_frames = 8 ) :
+				input_( input ),
+				source_( source ),
+				queue_frames_( std::max< size_t >( queue_frames, 1 ) ),
+				ladder_(),
+				outputs_() {}
+
+			void add( const rendition &r )
+			{
+				outputs_.emplace_back( new output( r, source_, queue_frames_ ) );
+				auto &ctx = *outputs_.back()->video->codec;
+				ladder_.add( ctx.width, ctx.height, ctx.pix_fmt, r.sws_flags );
+			}
+
+			// decodes the source to the end, returns when every rendition is written
+			// the first error of any rendition is rethrown
+			void run()
+			{
+				for ( auto &o : outputs_ )
+				{
+					auto out = o.get();
+					out->worker = std::thread( [out]{ out->run(); } );
+				}
+
+				try
+				{
+					source_.open_input( [this]( AVFrame &f )
+					{
+						auto frames = ladder_.scale( f );
+						for ( auto i = 0u; i < outputs_.size(); ++i )
+						{
+							// a failed rendition closes its queue, the others carry on
+							outputs_[ i ]->queue.push( std::move( frames[ i ] ) );
+						}
+						return true;
+					} );
+					input_.decode_all();
+				}
+				catch( ... )
+				{
+					stop();
+					throw;
+				}
+
+				stop();
+
+				for ( auto &o : outputs_ )
+				{
+					if ( o->error )
+					{
+						std::rethrow_exception( o->error );
+					}
+				}
+			}
+
+			std::vector< statistics > stats() const
+			{
+				std::vector< statistics > result;
+				for ( auto &o : outputs_ )
+				{
+					statistics s = { o->settings.filename, o->frames, o->queue.current(), o->rejected };
+					result.push_back( s );
+				}
+				return result;
+			}
+
+		private:
+
+			fanout( const fanout& );
+			fanout& operator = ( const fanout& );
+
+			struct output
+			{
+				output( const rendition &r, stream &source, size_t queue_frames ) :
+					settings( r ),
+					file( format::open_output( r.filename.c_str() ) ),
+					video( file.add_stream( r.codec ) ),
+					queue( std::make_shared< memory_budget >(), queue_frames ),
+					worker(),
+					error(),
+					frames( 0 ),
+					rejected()
+				{
+					auto &in = *source->codec;
+					auto &ctx = *video->codec;
+					ctx.width = r.width;
+					ctx.height = r.height;
+					ctx.bit_rate = r.bit_rate;
+					ctx.time_base = source->time_base;
+					ctx.framerate = source->avg_frame_rate;
+					ctx.sample_aspect_ratio = in.sample_aspect_ratio;
+					ctx.pix_fmt = r.pix_fmt;
+					if ( ctx.pix_fmt == AV_PIX_FMT_NONE )
+					{
+						ctx.pix_fmt = ctx.codec && ctx.codec->pix_fmts ? ctx.codec->pix_fmts[ 0 ] : AV_PIX_FMT_YUV420P;
+					}
+					if ( r.gop_size )
+					{
+						ctx.gop_size = r.gop_size;
+					}
+					video->time_base = ctx.time_base;
+
+					// frames are pushed by the fanout, the callback only marks the stream open
+					rejected = video.open_output( []( AVFrame& ) { return false; }, r.encoder );
+				}
+
+				~output()
+				{
+					if ( worker.joinable() )
+					{
+						queue.close();
+						worker.join();
+					}
+				}
+
+				void run()
+				{
+					try
+					{
+						packet p;
+						auto write = [this]( AVPacket &out )
+						{
+							av_interleaved_write_frame( file.ctx(), &out ) < av::error( "could not write frame" );
+						};
+
+						file.write_header();
+
+						frame::frame f;
+						while ( queue.pop( f ) )
+						{
+							av::encode( video, p, &convert( *f ), write );
+							++frames;
+						}
+
+						file.finish();
+					}
+					catch( ... )
+					{
+						error = std::current_exception();
+						queue.close();
+						queue.clear();
+					}
+				}
+
+				// frames come out of the ladder already scaled, only the timestamps need care
+				const AVFrame& convert( AVFrame &f )
+				{
+					f.pts = f.best_effort_timestamp != AV_NOPTS_VALUE ? f.best_effort_timestamp : f.pts;
+					f.pict_type = AV_PICTURE_TYPE_NONE;
+					return f;
+				}
+
+				rendition settings;
+				format::file file;
+				stream video;
+				frame_queue queue;
+				std::thread worker;
+				std::exception_ptr error;
+				std::atomic< size_t > frames;
+				std::vector< std::string > rejected;
+			};
+
+			void stop()
+			{
+				for ( auto &o : outputs_ )
+				{
+					o->queue.close();
+				}
+				for ( auto &o : outputs_ )
+				{
+					if ( o->worker.joinable() )
+					{
+						o->worker.join();
+					}
+				}
+			}
+
+			format::file &input_;
+			stream source_;
+			size_t queue_frames_;
+			sws::ladder ladder_;
+			std::vector< std::unique_ptr< output > > outputs_;
+	};
+}
+
+namespace av
+{
+	namespace filter
+	{
+		namespace helper
+		{
+			inline void free( AVFilterGraph *g )
+			{
+				avfilter_graph_free( &g );
+			}
+
+			inline void free( AVFilterInOut *i )
+			{
+				avfilter_inout_free( &i );
+			}
+
+			inline void register_all()
+			{
+				static std::once_flag once;
+				std::call_once( once, []{ avfilter_register_all(); } );
+			}
+		}
+
+		// a libavfilter graph built from a filter string such as "yadif,crop=640:360",
+		// configured from the first frame pushed into it and rebuilt when the input
+		// parameters change
+		// it can sit between av::decode and a stream callback ( wrap ) or feed an
+		// encoder ( source )
+		class graph
+		{
+			public:
+
+				// threads == 0 lets libavfilter pick the number of slice threads
+				graph( const std::string &description, AVRational time_base, int threads = 0 ) :
+					description_( description ),
+					time_base_( time_base ),
+					threads_( threads ),
+					graph_( nullptr, &helper::free ),
+					source_( nullptr ),
+					sink_( nullptr ),
+					input_(),
+					pool_(),
+					next_()
+				{
+					helper::register_all();
+				}
+
+				// hands a frame to the graph, nullptr signals the end of the input
+				void push( AVFrame *f )
+				{
+					if ( f && ( !graph_ || changed( *f ) ) )
+					{
+						configure( *f );
+					}
+					if ( !graph_ )
+					{
+						return;
+					}
+					av_buffersrc_add_frame_flags( source_, f, AV_BUFFERSRC_FLAG_KEEP_REF ) < error( "could not push frame into filter graph" );
+				}
+
+				codec::state pull( AVFrame &f )
+				{
+					if ( !graph_ )
+					{
+						return codec::state::again;
+					}
+					return codec::helper::check( av_buffersink_get_frame( sink_, &f ), "could not pull frame from filter graph" );
+				}
+
+				// a stream callback that filters every frame and hands the output to next
+				callback_t wrap( const callback_t &next )
+				{
+					next_ = next;
+					return [this]( AVFrame &f )
+					{
+						push( &f );
+						return drain();
+					};
+				}
+
+				// flushes the graph into the callback passed to wrap, call after decoding
+				void finish()
+				{
+					push( nullptr );
+					drain();
+				}
+
+				// an encoder callback that takes frames from producer, filters them and
+				// returns false once producer and graph are exhausted
+				callback_t source( const callback_t &producer )
+				{
+					return [this,producer]( AVFrame &out )
+					{
+						av_frame_unref( &out );
+						for ( ;; )
+						{
+							switch( pull( out ) )
+							{
+								case codec::state::ok:
+									return true;
+								case codec::state::eof:
+									return false;
+								case codec::state::again:
+									break;
+							}
+
+							auto in = pool_.acquire();
+							if ( producer( *in ) )
+							{
+								push( in.get() );
+							}
+							else if ( graph_ )
+							{
+								push( nullptr );
+							}
+							else
+							{
+								return false;
+							}
+							pool_.release( std::move( in ) );
+						}
+					};
+				}
+
+				// output time base, valid once the graph is configured
+				AVRational time_base() const
+				{
+					return sink_ ? av_buffersink_get_time_base( sink_ ) : time_base_;
+				}
+
+				AVFilterGraph* get() const
+				{
+					return graph_.get();
+				}
+
+			private:
+
+				graph( const graph& );
+				graph& operator = ( const graph& );
+
+				typedef std::unique_ptr< AVFilterGraph, void(*)( AVFilterGraph* ) > graph_type;
+				typedef std::unique_ptr< AVFilterInOut, void(*)( AVFilterInOut* ) > inout_type;
+
+				struct parameters
+				{
+					int format, width, height, sample_rate;
+					uint64_t channel_layout;
+					AVRational sample_aspect_ratio;
+				};
+
+				static parameters parameters_of( const AVFrame &f )
+				{
+					parameters result = { f.format, f.width, f.height, f.sample_rate, f.channel_layout, f.sample_aspect_ratio };
+					return result;
+				}
+
+				bool changed( const AVFrame &f ) const
+				{
+					auto p = parameters_of( f );
+					return p.format != input_.format || p.width != input_.width || p.height != input_.height
+						|| p.sample_rate != input_.sample_rate || p.channel_layout != input_.channel_layout;
+				}
+
+				bool drain()
+				{
+					auto out = pool_.acquire();
+					auto result = true;
+					while ( pull( *out ) == codec::state::ok )
+					{
+						result = next_( *out ) && result;
+						av_frame_unref( out.get() );
+					}
+					pool_.release( std::move( out ) );
+					return result;
+				}
+
+				void configure( const AVFrame &f )
+				{
+					// frames still inside the old graph are lost on a mid stream change
+					graph_type g( avfilter_graph_alloc() || error( "could not allocate filter graph" ), &helper::free );
+					g->nb_threads = threads_;
+					g->thread_type = AVFILTER_THREAD_SLICE;
+
+					const bool video = f.width > 0;
+					char args[ 512 ];
+					if ( video )
+					{
+						auto sar = f.sample_aspect_ratio.num ? f.sample_aspect_ratio : AVRational{ 0, 1 };
+						snprintf( args, sizeof( args ), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+							f.width, f.height, f.format, time_base_.num, time_base_.den, sar.num, sar.den );
+					}
+					else
+					{
+						snprintf( args, sizeof( args ), "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%llx",
+							time_base_.num, time_base_.den, f.sample_rate, av_get_sample_fmt_name( static_cast< AVSampleFormat >( f.format ) ),
+							static_cast< unsigned long long >( f.channel_layout ) );
+					}
+
+					AVFilterContext *src = nullptr, *sink = nullptr;
+					avfilter_graph_create_filter( &src, avfilter_get_by_name( video ? "buffer" : "abuffer" ), "in", args, nullptr, g.get() ) < error( "could not create filter source" );
+					avfilter_graph_create_filter( &sink, avfilter_get_by_name( video ? "buffersink" : "abuffersink" ), "out", nullptr, nullptr, g.get() ) < error( "could not create filter sink" );
+
+					inout_type outputs( avfilter_inout_alloc() || error( "could not allocate filter outputs" ), &helper::free );
+					inout_type inputs( avfilter_inout_alloc() || error( "could not allocate filter inputs" ), &helper::free );
+					outputs->name = av_strdup( "in" );
+					outputs->filter_ctx = src;
+					outputs->pad_idx = 0;
+					outputs->next = nullptr;
+					inputs->name = av_strdup( "out" );
+					inputs->filter_ctx = sink;
+					inputs->pad_idx = 0;
+					inputs->next = nullptr;
+
+					auto in = inputs.release(), out = outputs.release();
+					auto result = avfilter_graph_parse_ptr( g.get(), description_.c_str(), &in, &out, nullptr );
+					inputs.reset( in );
+					outputs.reset( out );
+					result < error( "could not parse filter graph", description_.c_str() );
+
+					avfilter_graph_config( g.get(), nullptr ) < error( "could not configure filter graph" );
+
+					graph_ = std::move( g );
+					source_ = src;
+					sink_ = sink;
+					input_ = parameters_of( f );
+				}
+
+				std::string description_;
+				AVRational time_base_;
+				int threads_;
+				graph_type graph_;
+				AVFilterContext *source_, *sink_;
+				parameters input_;
+				frame::pool pool_;
+				callback_t next_;
+		};
+	}
+}
+
+namespace av
+{
+	// kernels over contiguous arrays, with SSE2 versions where the target has it
+	namespace simd
+	{
+		// largest absolute value
+		inline float peak( const float *p, size_t n )
+		{
+			size_t i = 0;
+			float result = 0;
+#if defined( __SSE2__ )
+			const __m128 mask = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) );
+			__m128 m = _mm_setzero_ps();
+			for ( ; i + 4 <= n; i += 4 )
+			{
+				m = _mm_max_ps( m, _mm_and_ps( _mm_loadu_ps( p + i ), mask ) );
+			}
+			float lanes[ 4 ];
+			_mm_storeu_ps( lanes, m );
+			result = std::max( std::max( lanes[ 0 ], lanes[ 1 ] ), std::max( lanes[ 2 ], lanes[ 3 ] ) );
+#endif
+			for ( ; i < n; ++i )
+			{
+				result = std::max( result, std::fabs( p[ i ] ) );
+			}
+			return result;
+		}
+
+		// sum of squares, accumulated in double precision
+		inline double energy( const float *p, size_t n )
+		{
+			size_t i = 0;
+			double result = 0;
+#if defined( __SSE2__ )
+			__m128d lo = _mm_setzero_pd(), hi = _mm_setzero_pd();
+			for ( ; i + 4 <= n; i += 4 )
+			{
+				auto v = _mm_loadu_ps( p + i );
+				auto l = _mm_cvtps_pd( v ), h = _mm_cvtps_pd( _mm_movehl_ps( v, v ) );
+				lo = _mm_add_pd( lo, _mm_mul_pd( l, l ) );
+				hi = _mm_add_pd( hi, _mm_mul_pd( h, h ) );
+			}
+			double lanes[ 2 ];
+			_mm_storeu_pd( lanes, _mm_add_pd( lo, hi ) );
+			result = lanes[ 0 ] + lanes[ 1 ];
+#endif
+			for ( ; i < n; ++i )
+			{
+				result += double( p[ i ] ) * p[ i ];
+			}
+			return result;
+		}
+
+		inline float dot( const float *a, const float *b, size_t n )
+		{
+			size_t i = 0;
+			float result = 0;
+#if defined( __SSE2__ )
+			__m128 sum = _mm_setzero_ps();
+			for ( ; i + 4 <= n; i += 4 )
+			{
+				sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps( a + i ), _mm_loadu_ps( b + i ) ) );
+			}
+			float lanes[ 4 ];
+			_mm_storeu_ps( lanes, sum );
+			result = ( lanes[ 0 ] + lanes[ 1 ] ) + ( lanes[ 2 ] + lanes[ 3 ] );
+#endif
+			for ( ; i < n; ++i )
+			{
+				result += a[ i ] * b[ i ];
+			}
+			return result;
+		}
+
+		inline uint64_t sum( const uint8_t *p, size_t n )
+		{
+			size_t i = 0;
+			uint64_t result = 0;
+#if defined( __SSE2__ )
+			const __m128i zero = _mm_setzero_si128();
+			__m128i acc = zero;
+			for ( ; i + 16 <= n; i += 16 )
+			{
+				acc = _mm_add_epi64( acc, _mm_sad_epu8( _mm_loadu_si128( reinterpret_cast< const __m128i* >( p + i ) ), zero ) );
+			}
+			uint64_t lanes[ 2 ];
+			_mm_storeu_si128( reinterpret_cast< __m128i* >( lanes ), acc );
+			result = lanes[ 0 ] + lanes[ 1 ];
+#endif
+			for ( ; i < n; ++i )
+			{
+				result += p[ i ];
+			}
+			return result;
+		}
+
+		inline uint64_t sum_squares( const uint8_t *p, size_t n )
+		{
+			size_t i = 0;
+			uint64_t result = 0;
+#if defined( __SSE2__ )
+			// 32 bit lanes, flushed before they can overflow
+			const __m128i zero = _mm_setzero_si128();
+			while ( i + 16 <= n )
+			{
+				__m128i acc = zero;
+				auto end = std::min( n - 15, i + 16 * 4096 );
+				for ( ; i < end; i += 16 )
+				{
+					auto v = _mm_loadu_si128( reinterpret_cast< const __m128i* >( p + i ) );
+					auto lo = _mm_unpacklo_epi8( v, zero ), hi = _mm_unpackhi_epi8( v, zero );
+					acc = _mm_add_epi32( acc, _mm_add_epi32( _mm_madd_epi16( lo, lo ), _mm_madd_epi16( hi, hi ) ) );
+				}
+				uint32_t lanes[ 4 ];
+				_mm_storeu_si128( reinterpret_cast< __m128i* >( lanes ), acc );
+				result += uint64_t( lanes[ 0 ] ) + lanes[ 1 ] + lanes[ 2 ] + lanes[ 3 ];
+			}
+#endif
+			for ( ; i < n; ++i )
+			{
+				result += uint32_t( p[ i ] ) * p[ i ];
+			}
+			return result;
+		}
+
+		// sum of absolute differences
+		inline uint64_t sad( const uint8_t *a, const uint8_t *b, size_t n )
+		{
+			size_t i = 0;
+			uint64_t result = 0;
+#if defined( __SSE2__ )
+			__m128i acc = _mm_setzero_si128();
+			for ( ; i + 16 <= n; i += 16 )
+			{
+				acc = _mm_add_epi64( acc, _mm_sad_epu8( _mm_loadu_si128( reinterpret_cast< const __m128i* >( a + i ) ), _mm_loadu_si128( reinterpret_cast< const __m128i* >( b + i ) ) ) );
+			}
+			uint64_t lanes[ 2 ];
+			_mm_storeu_si128( reinterpret_cast< __m128i* >( lanes ), acc );
+			result = lanes[ 0 ] + lanes[ 1 ];
+#endif
+			for ( ; i < n; ++i )
+			{
+				result += std::abs( int( a[ i ] ) - int( b[ i ] ) );
+			}
+			return result;
+		}
+
+		// four partial histograms hide the store to load dependency between equal values,
+		// the rows of a frame are all added to the same partials, which are merged once
+		class histogram
+		{
+			public:
+
+				histogram() :
+					partial_() {}
+
+				void add( const uint8_t *p, size_t n )
+				{
+					size_t i = 0;
+					for ( ; i + 4 <= n; i += 4 )
+					{
+						++partial_[ 0 ][ p[ i ] ];
+						++partial_[ 1 ][ p[ i + 1 ] ];
+						++partial_[ 2 ][ p[ i + 2 ] ];
+						++partial_[ 3 ][ p[ i + 3 ] ];
+					}
+					for ( ; i < n; ++i )
+					{
+						++partial_[ 0 ][ p[ i ] ];
+					}
+				}
+
+				// adds the counts to bins and starts over
+				void merge( uint32_t *bins )
+				{
+					for ( auto b = 0; b < 256; ++b )
+					{
+						bins[ b ] += partial_[ 0 ][ b ] + partial_[ 1 ][ b ] + partial_[ 2 ][ b ] + partial_[ 3 ][ b ];
+					}
+					std::memset( partial_, 0, sizeof( partial_ ) );
+				}
+
+			private:
+
+				uint32_t partial_[ 4 ][ 256 ];
+		};
+	}
+
+	namespace audio
+	{
+		// converts one channel of any sample format to float
+		inline void to_float( const AVFrame &f, int channel, std::vector< float > &out )
+		{
+			auto format = static_cast< AVSampleFormat >( f.format );
+			auto planar = av_sample_fmt_is_planar( format );
+			auto n = size_t( f.nb_samples );
+			auto stride = planar ? 1 : size_t( f.channels );
+			auto data = f.extended_data[ planar ? channel : 0 ];
+			auto offset = planar ? 0 : size_t( channel );
+
+			out.resize( n );
+			switch ( av_get_packed_sample_fmt( format ) )
+			{
+				case AV_SAMPLE_FMT_U8:
+					for ( size_t i = 0; i < n; ++i )
+					{
+						out[ i ] = ( int( data[ i * stride + offset ] ) - 128 ) * ( 1.0f / 128 );
+					}
+					break;
+				case AV_SAMPLE_FMT_S16:
+					for ( size_t i = 0; i < n; ++i )
+					{
+						out[ i ] = reinterpret_cast< const int16_t* >( data )[ i * stride + offset ] * ( 1.0f / 32768 );
+					}
+					break;
+				case AV_SAMPLE_FMT_S32:
+					for ( size_t i = 0; i < n; ++i )
+					{
+						out[ i ] = reinterpret_cast< const int32_t* >( data )[ i * stride + offset ] * ( 1.0f / 2147483648.0f );
+					}
+					break;
+				case AV_SAMPLE_FMT_FLT:
+					if ( planar )
+					{
+						std::memcpy( out.data(), data, n * sizeof( float ) );
+					}
+					else
+					{
+						for ( size_t i = 0; i < n; ++i )
+						{
+							out[ i ] = reinterpret_cast< const float* >( data )[ i * stride + offset ];
+						}
+					}
+					break;
+				case AV_SAMPLE_FMT_DBL:
+					for ( size_t i = 0; i < n; ++i )
+					{
+						out[ i ] = float( reinterpret_cast< const double* >( data )[ i * stride + offset ] );
+					}
+					break;
+				default:
+					error( "audio" )( std::string( "unsupported sample format " ) + av_get_sample_fmt_name( format ) );
+			}
+		}
+
+		// peak, true-peak, rms and EBU R128 loudness of an audio stream, measured while it
+		// is decoded: attach it with wrap, the figures are final once decoding has finished
+		// the filtering is per channel and recursive, the per block work uses the simd kernels
+		class meter
+		{
+			public:
+
+				meter() :
+					rate_( 0 ),
+					channels_(),
+					samples_(),
+					samples_count_( 0 ),
+					step_( 0 ),
+					fill_( 0 ),
+					sub_energy_( 0 ),
+					subblocks_(),
+					blocks_(),
+					short_term_( -HUGE_VAL ),
+					max_short_term_( -HUGE_VAL ),
+					oversampling_( 1 ),
+					phases_(),
+					frames_( 0 ),
+					next_() {}
+
+				// a stream callback that meters every frame before handing it to next
+				callback_t wrap( const callback_t &next = callback_t() )
+				{
+					next_ = next;
+					return [this]( AVFrame &f )
+					{
+						push( f );
+						return next_ ? next_( f ) : true;
+					};
+				}
+
+				void push( const AVFrame &f )
+				{
+					if ( f.nb_samples <= 0 || f.channels <= 0 )
+					{
+						return;
+					}
+
+					if ( f.sample_rate != rate_ || size_t( f.channels ) != channels_.size() )
+					{
+						configure( f );
+					}
+
+					++frames_;
+					auto n = size_t( f.nb_samples );
+					for ( auto c = 0u; c < channels_.size(); ++c )
+					{
+						auto &ch = channels_[ c ];
+						to_float( f, c, samples_ );
+
+						ch.peak = std::max( ch.peak, simd::peak( samples_.data(), n ) );
+						ch.square_sum += simd::energy( samples_.data(), n );
+						ch.true_peak = std::max( ch.true_peak, true_peak( ch, samples_ ) );
+
+						ch.weighted.resize( n );
+						ch.filter( samples_.data(), ch.weighted.data(), n );
+					}
+					samples_count_ += n;
+
+					// split the frame at the 100ms boundaries of the gating blocks
+					for ( size_t pos = 0; pos < n; )
+					{
+						auto len = std::min( n - pos, step_ - fill_ );
+						for ( auto &ch : channels_ )
+						{
+							if ( ch.gain > 0 )
+							{
+								sub_energy_ += ch.gain * simd::energy( ch.weighted.data() + pos, len );
+							}
+						}
+						pos += len;
+						fill_ += len;
+						if ( fill_ == step_ )
+						{
+							complete_subblock();
+						}
+					}
+				}
+
+				size_t frames() const
+				{
+					return frames_;
+				}
+
+				// highest sample value over all channels, in dBFS
+				double peak() const
+				{
+					float result = 0;
+					for ( auto &ch : channels_ )
+					{
+						result = std::max( result, ch.peak );
+					}
+					return decibel( result );
+				}
+
+				// highest value of the oversampled signal, in dBTP
+				double true_peak() const
+				{
+					float result = 0;
+					for ( auto &ch : channels_ )
+					{
+						result = std::max( result, std::max( ch.peak, ch.true_peak ) );
+					}
+					return decibel( result );
+				}
+
+				// of all channels together, in dBFS
+				double rms() const
+				{
+					double sum = 0;
+					for ( auto &ch : channels_ )
+					{
+						sum += ch.square_sum;
+					}
+					auto count = double( samples_count_ ) * channels_.size();
+					return count > 0 ? 10 * std::log10( sum / count ) : -HUGE_VAL;
+				}
+
+				// gated loudness of the whole stream, in LUFS
+				double integrated() const
+				{
+					const double absolute = std::pow( 10.0, ( -70.0 + 0.691 ) / 10 );
+
+					double sum = 0;
+					size_t count = 0;
+					for ( auto z : blocks_ )
+					{
+						if ( z > absolute )
+						{
+							sum += z;
+							++count;
+						}
+					}
+					if ( !count )
+					{
+						return -HUGE_VAL;
+					}
+
+					// the relative gate is 10 LU below the absolute gated loudness
+					auto relative = std::max( absolute, sum / count * 0.1 );
+					sum = 0;
+					count = 0;
+					for ( auto z : blocks_ )
+					{
+						if ( z > relative )
+						{
+							sum += z;
+							++count;
+						}
+					}
+					return count ? loudness( sum / count ) : -HUGE_VAL;
+				}
+
+				// loudness of the last 3 seconds, in LUFS
+				double short_term() const
+				{
+					return short_term_;
+				}
+
+				double max_short_term() const
+				{
+					return max_short_term_;
+				}
+
+			private:
+
+				meter( const meter& );
+				meter& operator = ( const meter& );
+
+				struct biquad
+				{
+					double b0, b1, b2, a1, a2;
+				};
+
+				struct channel
+				{
+					double gain;
+					biquad shelf, highpass;
+					double z[ 4 ];
+					float peak, true_peak;
+					double square_sum;
+					std::vector< float > history, weighted;
+
+					// the K-weighting of BS.1770, a high shelf followed by a high pass,
+					// both in transposed direct form II
+					void filter( const float *in, float *out, size_t n )
+					{
+						for ( size_t i = 0; i < n; ++i )
+						{
+							double x = in[ i ];
+							auto y = shelf.b0 * x + z[ 0 ];
+							z[ 0 ] = shelf.b1 * x - shelf.a1 * y + z[ 1 ];
+							z[ 1 ] = shelf.b2 * x - shelf.a2 * y;
+							x = y;
+							y = highpass.b0 * x + z[ 2 ];
+							z[ 2 ] = highpass.b1 * x - highpass.a1 * y + z[ 3 ];
+							z[ 3 ] = highpass.b2 * x - highpass.a2 * y;
+							out[ i ] = float( y );
+						}
+					}
+				};
+
+				static const size_t taps = 12;
+
+				static double decibel( double linear )
+				{
+					return linear > 0 ? 20 * std::log10( linear ) : -HUGE_VAL;
+				}
+
+				static double loudness( double z )
+				{
+					return z > 0 ? -0.691 + 10 * std::log10( z ) : -HUGE_VAL;
+				}
+
+				// the LFE channel is not measured, surround channels weigh 1.41
+				static double gain_of( uint64_t ch )
+				{
+					if ( ch & ( AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2 ) )
+					{
+						return 0;
+					}
+					if ( ch & ( AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT | AV_CH_BACK_LEFT | AV_CH_BACK_RIGHT ) )
+					{
+						return 1.41;
+					}
+					return 1;
+				}
+
+				void configure( const AVFrame &f )
+				{
+					rate_ = f.sample_rate;
+					step_ = std::max( rate_ / 10, 1 );
+					fill_ = 0;
+					sub_energy_ = 0;
+					subblocks_.clear();
+
+					// M_PI is not standard, msvc only has it with _USE_MATH_DEFINES
+					constexpr double pi = 3.14159265358979323846;
+
+					// coefficients for any sample rate, as derived in libebur128
+					auto K = std::tan( pi * 1681.974450955533 / rate_ );
+					auto Q = 0.7071752369554196;
+					auto Vh = std::pow( 10.0, 3.999843853973347 / 20 );
+					auto Vb = std::pow( Vh, 0.4996667741545416 );
+					auto a0 = 1 + K / Q + K * K;
+					biquad shelf = { ( Vh + Vb * K / Q + K * K ) / a0, 2 * ( K * K - Vh ) / a0, ( Vh - Vb * K / Q + K * K ) / a0, 2 * ( K * K - 1 ) / a0, ( 1 - K / Q + K * K ) / a0 };
+
+					K = std::tan( pi * 38.13547087602444 / rate_ );
+					Q = 0.5003270373238773;
+					a0 = 1 + K / Q + K * K;
+					biquad highpass = { 1, -2, 1, 2 * ( K * K - 1 ) / a0, ( 1 - K / Q + K * K ) / a0 };
+
+					auto layout = f.channel_layout ? f.channel_layout : uint64_t( av_get_default_channel_layout( f.channels ) );
+					std::vector< channel > channels( f.channels );
+					for ( auto c = 0u; c < channels.size(); ++c )
+					{
+						auto &ch = channels[ c ];
+						ch.gain = layout ? gain_of( av_channel_layout_extract_channel( layout, c ) ) : 1;
+						ch.shelf = shelf;
+						ch.highpass = highpass;
+						std::fill( std::begin( ch.z ), std::end( ch.z ), 0.0 );
+						ch.history.assign( taps - 1, 0 );
+						// peaks and energy carry over a format change
+						ch.peak = c < channels_.size() ? channels_[ c ].peak : 0;
+						ch.true_peak = c < channels_.size() ? channels_[ c ].true_peak : 0;
+						ch.square_sum = c < channels_.size() ? channels_[ c ].square_sum : 0;
+					}
+					channels_ = std::move( channels );
+
+					// 4 times oversampling below 96kHz, twice below 192kHz
+					oversampling_ = rate_ < 96000 ? 4 : rate_ < 192000 ? 2 : 1;
+					phases_.assign( oversampling_, std::vector< float >( taps ) );
+					auto length = taps * oversampling_;
+					auto centre = double( taps / 2 * oversampling_ );
+					for ( size_t p = 0; p < oversampling_; ++p )
+					{
+						for ( size_t k = 0; k < taps; ++k )
+						{
+							// windowed sinc, stored reversed so a phase is a plain dot product over the history
+							auto n = p + k * oversampling_;
+							auto x = ( n - centre ) / oversampling_;
+							auto sinc = x == 0 ? 1.0 : std::sin( pi * x ) / ( pi * x );
+							auto window = 0.5 - 0.5 * std::cos( 2 * pi * ( n + 0.5 ) / length );
+							phases_[ p ][ taps - 1 - k ] = float( sinc * window );
+						}
+
+						// unity gain at DC for every phase
+						auto &phase = phases_[ p ];
+						auto sum = std::accumulate( phase.begin(), phase.end(), 0.0f );
+						for ( auto &c : phase )
+						{
+							c /= sum;
+						}
+					}
+				}
+
+				// peak of the interpolated samples between the decoded ones
+				float true_peak( channel &ch, const std::vector< float > &samples )
+				{
+					if ( oversampling_ == 1 )
+					{
+						return 0;
+					}
+
+					auto &h = ch.history;
+					h.insert( h.end(), samples.begin(), samples.end() );
+
+					float result = 0;
+					for ( size_t i = 0; i + taps <= h.size(); ++i )
+					{
+						for ( size_t p = 1; p < oversampling_; ++p )
+						{
+							result = std::max( result, std::fabs( simd::dot( h.data() + i, phases_[ p ].data(), taps ) ) );
+						}
+					}
+
+					h.erase( h.begin(), h.end() - ( taps - 1 ) );
+					return result;
+				}
+
+				void complete_subblock()
+				{
+					subblocks_.push_back( sub_energy_ / step_ );
+					if ( subblocks_.size() > 30 )
+					{
+						subblocks_.pop_front();
+					}
+					sub_energy_ = 0;
+					fill_ = 0;
+
+					// 400ms gating blocks overlapping by 75%
+					if ( subblocks_.size() >= 4 )
+					{
+						blocks_.push_back( ( subblocks_[ subblocks_.size() - 1 ] + subblocks_[ subblocks_.size() - 2 ] + subblocks_[ subblocks_.size() - 3 ] + subblocks_[ subblocks_.size() - 4 ] ) / 4 );
+					}
+
+					if ( subblocks_.size() == 30 )
+					{
+						double sum = 0;
+						for ( auto z : subblocks_ )
+						{
+							sum += z;
+						}
+						short_term_ = loudness( sum / 30 );
+						max_short_term_ = std::max( max_short_term_, short_term_ );
+					}
+				}
+
+				int rate_;
+				std::vector< channel > channels_;
+				std::vector< float > samples_;
+				size_t samples_count_;
+				size_t step_, fill_;
+				double sub_energy_;
+				std::deque< double > subblocks_;
+				std::vector< double > blocks_;
+				double short_term_, max_short_term_;
+				size_t oversampling_;
+				std::vector< std::vector< float > > phases_;
+				size_t frames_;
+				callback_t next_;
+		};
+	}
+}
+
+namespace av
+{
+	namespace video
+	{
+		// figures of a single decoded frame, computed on its 8 bit luma and chroma planes
+		struct statistics
+		{
+			int64_t pts;
+			std::array< uint32_t, 256 > histogram;
+			double mean;
+			double variance;
+			// of the two chroma components, -1 for formats without chroma
+			double chroma_mean[ 2 ];
+			// mean absolute luma gradient, low for blurry frames
+			double sharpness;
+			// luma gradient across 8x8 block edges relative to inside the blocks, 1 when blocks do not show
+			double blockiness;
+			// mean absolute luma difference with the previous frame
+			double difference;
+			// histogram distance to the previous frame, from 0 to 1
+			double scene_score;
+			bool scene_change;
+		};
+
+		typedef std::function< bool( AVFrame &frame, const statistics &stats ) > analysis_callback_t;
+
+		// computes statistics for every frame of a video stream and hands them to the
+		// stream callback together with the frame, without converting it first
+		class analyzer
+		{
+			public:
+
+				analyzer( double threshold = 0.4 ) :
+					threshold_( threshold ),
+					stats_(),
+					previous_(),
+					previous_histogram_(),
+					histogram_(),
+					width_( 0 ),
+					height_( 0 ),
+					frames_( 0 ),
+					scene_changes_( 0 ),
+					next_() {}
+
+				callback_t wrap( const analysis_callback_t &next )
+				{
+					next_ = next;
+					return [this]( AVFrame &f )
+					{
+						return next_( f, analyze( f ) );
+					};
+				}
+
+				const statistics& analyze( const AVFrame &f )
+				{
+					auto desc = av_pix_fmt_desc_get( static_cast< AVPixelFormat >( f.format ) );
+					if ( !desc || ( desc->flags & AV_PIX_FMT_FLAG_RGB ) || desc->comp[ 0 ].depth != 8 || desc->comp[ 0 ].step != 1 )
+					{
+						error( "video analyzer" )( std::string( "unsupported pixel format " ) + ( desc ? desc->name : "none" ) );
+					}
+
+					auto &s = stats_;
+					auto width = size_t( f.width ), height = size_t( f.height );
+					auto luma = f.data[ desc->comp[ 0 ].plane ];
+					auto stride = f.linesize[ desc->comp[ 0 ].plane ];
+
+					s.pts = f.pts;
+					s.histogram.fill( 0 );
+
+					uint64_t sum = 0, squares = 0, horizontal = 0, vertical = 0, vertical_edges = 0, horizontal_edges = 0;
+					for ( size_t y = 0; y < height; ++y )
+					{
+						auto row = luma + ptrdiff_t( y ) * stride;
+						histogram_.add( row, width );
+						sum += simd::sum( row, width );
+						squares += simd::sum_squares( row, width );
+						if ( width > 1 )
+						{
+							horizontal += simd::sad( row, row + 1, width - 1 );
+							for ( size_t x = 7; x + 1 < width; x += 8 )
+							{
+								horizontal_edges += std::abs( int( row[ x ] ) - int( row[ x + 1 ] ) );
+							}
+						}
+						if ( y + 1 < height )
+						{
+							auto d = simd::sad( row, row + stride, width );
+							vertical += d;
+							if ( y % 8 == 7 )
+							{
+								vertical_edges += d;
+							}
+						}
+					}
+					histogram_.merge( s.histogram.data() );
+
+					auto pixels = double( width * height );
+					s.mean = pixels ? sum / pixels : 0;
+					s.variance = pixels ? squares / pixels - s.mean * s.mean : 0;
+
+					auto gradients = double( ( width ? width - 1 : 0 ) * height + width * ( height ? height - 1 : 0 ) );
+					s.sharpness = gradients ? ( horizontal + vertical ) / gradients : 0;
+
+					// the mean gradient on block edges against the mean gradient everywhere else
+					auto edges = double( ( width > 1 ? ( width - 1 ) / 8 : 0 ) * height + width * ( height > 1 ? ( height - 1 ) / 8 : 0 ) );
+					auto inner = gradients - edges;
+					auto edge_mean = edges ? ( horizontal_edges + vertical_edges ) / edges : 0;
+					auto inner_mean = inner ? ( horizontal + vertical - horizontal_edges - vertical_edges ) / inner : 0;
+					s.blockiness = edge_mean ? ( edge_mean + 1 ) / ( inner_mean + 1 ) : 1;
+
+					for ( auto c = 0; c < 2; ++c )
+					{
+						s.chroma_mean[ c ] = desc->nb_components >= 3 ? chroma_mean( f, *desc, c + 1 ) : -1;
+					}
+
+					compare( luma, stride, width, height );
+
+					++frames_;
+					if ( s.scene_change )
+					{
+						++scene_changes_;
+					}
+					return s;
+				}
+
+				const statistics& last() const
+				{
+					return stats_;
+				}
+
+				size_t frames() const
+				{
+					return frames_;
+				}
+
+				size_t scene_changes() const
+				{
+					return scene_changes_;
+				}
+
+			private:
+
+				analyzer( const analyzer& );
+				analyzer& operator = ( const analyzer& );
+
+				static double chroma_mean( const AVFrame &f, const AVPixFmtDescriptor &desc, int component )
+				{
+					auto &comp = desc.comp[ component ];
+					auto width = size_t( -( ( -f.width ) >> desc.log2_chroma_w ) );
+					auto height = size_t( -( ( -f.height ) >> desc.log2_chroma_h ) );
+					auto plane = f.data[ comp.plane ];
+					auto stride = f.linesize[ comp.plane ];
+					if ( !plane || comp.depth != 8 || !width || !height )
+					{
+						return -1;
+					}
+
+					uint64_t sum = 0;
+					for ( size_t y = 0; y < height; ++y )
+					{
+						auto row = plane + ptrdiff_t( y ) * stride + comp.offset;
+						if ( comp.step == 1 )
+						{
+							sum += simd::sum( row, width );
+						}
+						else
+						{
+							for ( size_t x = 0; x < width; ++x )
+							{
+								sum += row[ x * comp.step ];
+							}
+						}
+					}
+					return double( sum ) / ( width * height );
+				}
+
+				// against the previous frame, which is kept as a copy of its luma plane
+				void compare( const uint8_t *luma, int stride, size_t width, size_t height )
+				{
+					auto &s = stats_;
+					auto pixels = width * height;
+					auto first = width != width_ || height != height_;
+
+					s.difference = 0;
+					s.scene_score = 0;
+					if ( !first && pixels )
+					{
+						uint64_t diff = 0;
+						for ( size_t y = 0; y < height; ++y )
+						{
+							diff += simd::sad( luma + ptrdiff_t( y ) * stride, previous_.data() + y * width, width );
+						}
+						s.difference = double( diff ) / pixels;
+
+						uint64_t distance = 0;
+						for ( auto b = 0; b < 256; ++b )
+						{
+							distance += std::abs( int64_t( s.histogram[ b ] ) - int64_t( previous_histogram_[ b ] ) );
+						}
+						s.scene_score = double( distance ) / ( 2 * pixels );
+					}
+					s.scene_change = !first && s.scene_score > threshold_;
+
+					width_ = width;
+					height_ = height;
+					previous_.resize( pixels );
+					for ( size_t y = 0; y < height; ++y )
+					{
+						std::memcpy( previous_.data() + y * width, luma + ptrdiff_t( y ) * stride, width );
+					}
+					previous_histogram_ = s.histogram;
+				}
+
+				double threshold_;
+				statistics stats_;
+				std::vector< uint8_t > previous_;
+				std::array< uint32_t, 256 > previous_histogram_;
+				simd::histogram histogram_;
+				size_t width_, height_;
+				size_t frames_, scene_changes_;
+				analysis_callback_t next_;
+		};
+	}
+}
+
+namespace av
+{
+	// still images from memory, decoded without a demuxer: no probing and no io context,
+	// the opened decoder is kept for the next image
+	namespace image
+	{
+		typedef std::function< bool( size_t index, AVFrame &frame ) > batch_callback_t;
+
+		namespace helper
+		{
+			template < typename T >
+			const uint8_t* data_of( const T &blob )
+			{
+				return reinterpret_cast< const uint8_t* >( blob.data() );
+			}
+		}
+
+		class decoder
+		{
+			public:
+
+				decoder( AVCodecID id = AV_CODEC_ID_MJPEG ) :
+					codec_( codec::make_context( avcodec_find_decoder( id ) || error( "could not find decoder", avcodec_get_name( id ) ) ) ),
+					padded_()
+				{
+					// one image at a time, frame threads would only hold frames back
+					codec_->thread_count = 1;
+					codec::open_input( *codec_ );
+				}
+
+				// decodes one complete image, frame is unreferenced first
+				status decode( const uint8_t *data, size_t size, AVFrame &frame, const std::nothrow_t& )
+				{
+					av_frame_unref( &frame );
+
+					// decoders may read past the end of their input
+					padded_.resize( size + AV_INPUT_BUFFER_PADDING_SIZE );
+					std::memcpy( padded_.data(), data, size );
+					std::memset( padded_.data() + size, 0, AV_INPUT_BUFFER_PADDING_SIZE );
+
+					AVPacket p;
+					av_init_packet( &p );
+					p.data = padded_.data();
+					p.size = int( size );
+					p.flags = AV_PKT_FLAG_KEY;
+
+					auto sent = codec::send_packet( *codec_, &p, std::nothrow );
+					if ( !sent )
+					{
+						return sent;
+					}
+					auto received = codec::receive_frame( *codec_, frame, std::nothrow );
+					if ( received.again() )
+					{
+						return status( AVERROR_INVALIDDATA, "decoder produced no image" );
+					}
+					return received;
+				}
+
+				void decode( const uint8_t *data, size_t size, AVFrame &frame )
+				{
+					decode( data, size, frame, std::nothrow ).raise();
+				}
+
+				frame::frame decode( const uint8_t *data, size_t size )
+				{
+					auto result = frame::alloc();
+					decode( data, size, *result );
+					return result;
+				}
+
+				// decodes every blob of the range in order, each needs data() and size(),
+				// stops early when the callback returns false, returns the number decoded
+				template < typename Iterator >
+				size_t decode( Iterator begin, Iterator end, const batch_callback_t &cb )
+				{
+					auto frame = frame::alloc();
+					size_t index = 0;
+					for ( auto i = begin; i != end; ++i, ++index )
+					{
+						decode( helper::data_of( *i ), i->size(), *frame );
+						if ( !cb( index, *frame ) )
+						{
+							return index + 1;
+						}
+					}
+					return index;
+				}
+
+				AVCodecContext* get() const
+				{
+					return codec_.get();
+				}
+
+			private:
+
+				decoder( const decoder& );
+				decoder& operator = ( const decoder& );
+
+				codec::context codec_;
+				std::vector< uint8_t > padded_;
+		};
+
+		// opened decoders for any number of threads, each one used by a single thread at a time
+		class decoder_pool
+		{
+			public:
+
+				decoder_pool( AVCodecID id = AV_CODEC_ID_MJPEG ) :
+					id_( id ),
+					mutex_(),
+					idle_(),
+					opened_( 0 ) {}
+
+				// borrows a decoder for as long as it lives
+				class lease
+				{
+					public:
+
+						lease( decoder_pool &pool ) :
+							pool_( &pool ),
+							decoder_( pool.acquire() ) {}
+
+						lease( lease &&rhs ) :
+							pool_( rhs.pool_ ),
+							decoder_( std::move( rhs.decoder_ ) ) {}
+
+						~lease()
+						{
+							if ( decoder_ )
+							{
+								pool_->release( std::move( decoder_ ) );
+							}
+						}
+
+						decoder* operator ->() const
+						{
+							return decoder_.get();
+						}
+
+						decoder& operator *() const
+						{
+							return *decoder_;
+						}
+
+					private:
+
+						lease( const lease& );
+						lease& operator = ( const lease& );
+
+						decoder_pool *pool_;
+						std::unique_ptr< decoder > decoder_;
+				};
+
+				lease borrow()
+				{
+					return lease( *this );
+				}
+
+				void decode( const uint8_t *data, size_t size, AVFrame &frame )
+				{
+					borrow()->decode( data, size, frame );
+				}
+
+				// splits the range over threads, each with its own decoder and frame, the
+				// callback is called from all of them at once and has to be thread safe
+				// the first error stops the batch and is rethrown
+				template < typename Iterator >
+				size_t decode( Iterator begin, Iterator end, const batch_callback_t &cb, size_t threads = 0 )
+				{
+					const size_t count = std::distance( begin, end );
+					if ( !threads )
+					{
+						threads = std::max( std::thread::hardware_concurrency(), 1u );
+					}
+					threads = std::max< size_t >( std::min( threads, count ), 1 );
+
+					std::atomic< size_t > next( 0 ), decoded( 0 );
+					std::atomic< bool > stop( false );
+					std::exception_ptr failure;
+					std::mutex failure_mutex;
+
+					auto work = [&]()
+					{
+						try
+						{
+							auto d = borrow();
+							auto frame = frame::alloc();
+							for ( size_t i; !stop && ( i = next++ ) < count; )
+							{
+								auto &blob = *std::next( begin, i );
+								d->decode( helper::data_of( blob ), blob.size(), *frame );
+								++decoded;
+								if ( !cb( i, *frame ) )
+								{
+									stop = true;
+								}
+							}
+						}
+						catch ( ... )
+						{
+							std::lock_guard< std::mutex > lock( failure_mutex );
+							if ( !failure )
+							{
+								failure = std::current_exception();
+							}
+							stop = true;
+						}
+					};
+
+					std::vector< std::thread > workers;
+					for ( size_t t = 1; t < threads; ++t )
+					{
+						workers.emplace_back( work );
+					}
+					work();
+					for ( auto &w : workers )
+					{
+						w.join();
+					}
+
+					if ( failure )
+					{
+						std::rethrow_exception( failure );
+					}
+					return decoded;
+				}
+
+				// number of decoders opened so far
+				size_t size() const
+				{
+					return opened_;
+				}
+
+			private:
+
+				decoder_pool( const decoder_pool& );
+				decoder_pool& operator = ( const decoder_pool& );
+
+				std::unique_ptr< decoder > acquire()
+				{
+					{
+						std::lock_guard< std::mutex > lock( mutex_ );
+						if ( !idle_.empty() )
+						{
+							auto result = std::move( idle_.back() );
+							idle_.pop_back();
+							return result;
+						}
+					}
+					std::unique_ptr< decoder > result( new decoder( id_ ) );
+					++opened_;
+					return result;
+				}
+
+				void release( std::unique_ptr< decoder > &&d )
+				{
+					std::lock_guard< std::mutex > lock( mutex_ );
+					idle_.push_back( std::move( d ) );
+				}
+
+				AVCodecID id_;
+				std::mutex mutex_;
+				std::vector< std::unique_ptr< decoder > > idle_;
+				std::atomic< size_t > opened_;
+		};
+
+		// still image encoder without a muxer, opened for one size, pixel format and quality
+		class encoder
+		{
+			public:
+
+				// quality is a fixed quantizer, 2 is best and 31 worst
+				encoder( int width, int height, AVPixelFormat format = AV_PIX_FMT_YUVJ420P, int quality = 3, AVCodecID id = AV_CODEC_ID_MJPEG ) :
+					codec_( codec::make_context( avcodec_find_encoder( id ) || error( "could not find encoder", avcodec_get_name( id ) ) ) ),
+					packet_(),
+					input_( frame::alloc() ),
+					quality_( FF_QP2LAMBDA * quality ),
+					count_( 0 )
+				{
+					auto &ctx = *codec_;
+					ctx.width = width;
+					ctx.height = height;
+					ctx.pix_fmt = format;
+					ctx.time_base.num = 1;
+					ctx.time_base.den = 25;
+					ctx.flags |= AV_CODEC_FLAG_QSCALE;
+					ctx.global_quality = quality_;
+					// yuv420p next to the full range yuvj formats
+					ctx.strict_std_compliance = FF_COMPLIANCE_UNOFFICIAL;
+					ctx.thread_count = 1;
+					codec::open_output( ctx );
+				}
+
+				bool accepts( const AVFrame &f ) const
+				{
+					auto &ctx = *codec_.get();
+					return f.width == ctx.width && f.height == ctx.height && f.format == ctx.pix_fmt;
+				}
+
+				// the packet references the encoder's output, no copy is made
+				status encode( const AVFrame &frame, AVPacket &out, const std::nothrow_t& )
+				{
+					if ( !accepts( frame ) )
+					{
+						return status( AVERROR( EINVAL ), "frame does not match the encoder" );
+					}
+
+					// a new reference carries the quality and timestamp without touching the caller's
+					// frame, frames that are not reference counted only lend their planes for the call
+					auto &input = *input_;
+					if ( frame.buf[ 0 ] )
+					{
+						status referenced( av_frame_ref( &input, &frame ), "could not reference frame" );
+						if ( !referenced )
+						{
+							return referenced;
+						}
+					}
+					else
+					{
+						std::copy( frame.data, frame.data + AV_NUM_DATA_POINTERS, input.data );
+						std::copy( frame.linesize, frame.linesize + AV_NUM_DATA_POINTERS, input.linesize );
+						input.format = frame.format;
+						input.width = frame.width;
+						input.height = frame.height;
+						status copied( av_frame_copy_props( &input, &frame ), "could not copy frame properties" );
+						if ( !copied )
+						{
+							av_frame_unref( &input );
+							return copied;
+						}
+					}
+					input.quality = quality_;
+					input.pts = count_++;
+
+					av_packet_unref( &out );
+					auto sent = codec::send_frame( *codec_, &input, std::nothrow );
+					av_frame_unref( &input );
+					if ( !sent )
+					{
+						return sent;
+					}
+					return codec::receive_packet( *codec_, out, std::nothrow );
+				}
+
+				// the returned packet is reference counted and can be kept or handed on
+				packet_ptr encode( const AVFrame &frame )
+				{
+					packet_ptr result( av_packet_alloc() || error( "could not allocate packet" ) );
+					encode( frame, *result.get(), std::nothrow ).raise();
+					return result;
+				}
+
+				// replaces the contents of out, its capacity is reused
+				size_t encode( const AVFrame &frame, std::vector< uint8_t > &out )
+				{
+					encode( frame, packet_, std::nothrow ).raise();
+					out.assign( packet_.data, packet_.data + packet_.size );
+					av_packet_unref( &packet_ );
+					return out.size();
+				}
+
+				// into a buffer the caller owns, fails when it is too small
+				size_t encode( const AVFrame &frame, uint8_t *out, size_t capacity )
+				{
+					encode( frame, packet_, std::nothrow ).raise();
+					auto size = size_t( packet_.size );
+					if ( size > capacity )
+					{
+						av_packet_unref( &packet_ );
+						error( "could not encode image" )( "output buffer of " + std::to_string( capacity ) + " bytes is too small for " + std::to_string( size ) );
+					}
+					std::memcpy( out, packet_.data, size );
+					av_packet_unref( &packet_ );
+					return size;
+				}
+
+				size_t encode( const sws::helper &image, std::vector< uint8_t > &out )
+				{
+					auto f = frame::alloc();
+					image.to_avframe( *f );
+					return encode( *f, out );
+				}
+
+				AVCodecContext* get() const
+				{
+					return codec_.get();
+				}
+
+			private:
+
+				encoder( const encoder& );
+				encoder& operator = ( const encoder& );
+
+				codec::context codec_;
+				packet packet_;
+				frame::frame input_;
+				int quality_;
+				int64_t count_;
+		};
+
+		// opened encoders shared by any number of threads, one per frame size, pixel format
+		// and quality in use at the same time
+		class encoder_pool
+		{
+			public:
+
+				encoder_pool( int quality = 3, AVCodecID id = AV_CODEC_ID_MJPEG ) :
+					quality_( quality ),
+					id_( id ),
+					mutex_(),
+					idle_(),
+					opened_( 0 ) {}
+
+				class lease
+				{
+					public:
+
+						lease( encoder_pool &pool, const AVFrame &f ) :
+							pool_( &pool ),
+							encoder_( pool.acquire( f ) ) {}
+
+						lease( lease &&rhs ) :
+							pool_( rhs.pool_ ),
+							encoder_( std::move( rhs.encoder_ ) ) {}
+
+						~lease()
+						{
+							if ( encoder_ )
+							{
+								pool_->release( std::move( encoder_ ) );
+							}
+						}
+
+						encoder* operator ->() const
+						{
+							return encoder_.get();
+						}
+
+						encoder& operator *() const
+						{
+							return *encoder_;
+						}
+
+					private:
+
+						lease( const lease& );
+						lease& operator = ( const lease& );
+
+						encoder_pool *pool_;
+						std::unique_ptr< encoder > encoder_;
+				};
+
+				// an encoder for frames like f, opened when none is idle
+				lease borrow( const AVFrame &f )
+				{
+					return lease( *this, f );
+				}
+
+				packet_ptr encode( const AVFrame &frame )
+				{
+					return borrow( frame )->encode( frame );
+				}
+
+				size_t encode( const AVFrame &frame, std::vector< uint8_t > &out )
+				{
+					return borrow( frame )->encode( frame, out );
+				}
+
+				size_t encode( const AVFrame &frame, uint8_t *out, size_t capacity )
+				{
+					return borrow( frame )->encode( frame, out, capacity );
+				}
+
+				size_t encode( const sws::helper &image, std::vector< uint8_t > &out )
+				{
+					auto f = frame::alloc();
+					image.to_avframe( *f );
+					return encode( *f, out );
+				}
+
+				// number of encoders opened so far
+				size_t size() const
+				{
+					return opened_;
+				}
+
+			private:
+
+				encoder_pool( const encoder_pool& );
+				encoder_pool& operator = ( const encoder_pool& );
+
+				std::unique_ptr< encoder > acquire( const AVFrame &f )
+				{
+					{
+						std::lock_guard< std::mutex > lock( mutex_ );
+						for ( auto i = idle_.begin(); i != idle_.end(); ++i )
+						{
+							if ( ( *i )->accepts( f ) )
+							{
+								auto result = std::move( *i );
+								idle_.erase( i );
+								return result;
+							}
+						}
+					}
+					std::unique_ptr< encoder > result( new encoder( f.width, f.height, static_cast< AVPixelFormat >( f.format ), quality_, id_ ) );
+					++opened_;
+					return result;
+				}
+
+				void release( std::unique_ptr< encoder > &&e )
+				{
+					std::lock_guard< std::mutex > lock( mutex_ );
+					idle_.push_back( std::move( e ) );
+				}
+
+				int quality_;
+				AVCodecID id_;
+				std::mutex mutex_;
+				std::vector< std::unique_ptr< encoder > > idle_;
+				std::atomic< size_t > opened_;
+		};
+	}
+}
+
+namespace av
+{
+	// routes av_log output through a bounded lock-free ring to a background thread, so
+	// a noisy input costs its decode thread a formatted message at most, never a lock
+	// or a write to stderr
+	namespace log
+	{
+		struct record
+		{
+			int level;
+			const void *context;
+			// -1 unless the context was tagged with a stream
+			int stream;
+			std::chrono::steady_clock::time_point time;
+			char name[ 32 ];
+			char message[ 256 ];
+		};
+
+		typedef std::function< void( const record& ) > sink_t;
+
+		// writes a record the way av_log would
+		inline void to_stderr( const record &r )
+		{
+			auto length = strnlen( r.message, sizeof( r.message ) );
+			while ( length && r.message[ length - 1 ] == '\n' )
+			{
+				--length;
+			}
+			if ( r.stream >= 0 )
+			{
+				fprintf( stderr, "[%s #%d @ %p] %.*s\n", r.name, r.stream, r.context, int( length ), r.message );
+			}
+			else if ( r.context )
+			{
+				fprintf( stderr, "[%s @ %p] %.*s\n", r.name, r.context, int( length ), r.message );
+			}
+			else
+			{
+				fprintf( stderr, "%.*s\n", int( length ), r.message );
+			}
+		}
+
+		struct options
+		{
+			options() :
+				level( AV_LOG_INFO ),
+				capacity( 1024 ),
+				per_second( 50 ),
+				interval( std::chrono::milliseconds( 10 ) ),
+				sink( &to_stderr ) {}
+
+			// messages above this level are discarded before they are formatted
+			int level;
+			// number of records in the ring, rounded up to a power of two
+			size_t capacity;
+			// messages per context per second, the rest is counted and dropped
+			size_t per_second;
+			// how long the drain thread sleeps when the ring is empty
+			std::chrono::milliseconds interval;
+			// called from the drain thread only
+			sink_t sink;
+		};
+
+		struct statistics
+		{
+			size_t written;
+			size_t rate_limited;
+			size_t overflowed;
+		};
+
+		// installs itself as the av_log callback for its lifetime, only one can be active
+		class router
+		{
+			public:
+
+				router( const options &o = options() ) :
+					options_( o ),
+					cells_(),
+					mask_( 0 ),
+					head_( 0 ),
+					tail_( 0 ),
+					slots_(),
+					shared_(),
+					written_( 0 ),
+					rate_limited_( 0 ),
+					overflowed_( 0 ),
+					running_( true ),
+					drain_()
+				{
+					size_t capacity = 1;
+					while ( capacity < std::max< size_t >( options_.capacity, 2 ) )
+					{
+						capacity <<= 1;
+					}
+					mask_ = capacity - 1;
+					cells_.reset( new cell[ capacity ] );
+					for ( size_t i = 0; i < capacity; ++i )
+					{
+						cells_[ i ].sequence = i;
+					}
+					for ( auto &s : slots_ )
+					{
+						clear( s );
+					}
+					clear( shared_ );
+
+					router *expected = nullptr;
+					if ( !active().compare_exchange_strong( expected, this ) )
+					{
+						error( "log router" )( "another router is already installed" );
+					}
+					drain_ = std::thread( [this]() { run(); } );
+					av_log_set_callback( &callback );
+				}
+
+				~router()
+				{
+					av_log_set_callback( &av_log_default_callback );
+					active() = nullptr;
+					// threads that picked up this router before it was uninstalled
+					while ( callers() )
+					{
+						std::this_thread::yield();
+					}
+					running_ = false;
+					drain_.join();
+				}
+
+				// records of this context carry the stream index, contexts that find the table
+				// full stay untagged
+				void tag( const void *context, int stream )
+				{
+					if ( auto s = context ? find( context, true ) : nullptr )
+					{
+						s->stream = stream;
+					}
+				}
+
+				// frees the slot of a context, so a new context at the same address starts afresh
+				void untag( const void *context )
+				{
+					if ( auto s = context ? find( context, false ) : nullptr )
+					{
+						clear( *s, tombstone() );
+					}
+				}
+
+				// untags a context in the installed router, if any
+				static void forget( const void *context )
+				{
+					++callers();
+					if ( auto r = active().load() )
+					{
+						r->untag( context );
+					}
+					--callers();
+				}
+
+				// tags the codec context of every stream of a file with its index
+				void tag( const format::file &f )
+				{
+					for ( auto &s : f.view() )
+					{
+						if ( s.get() && s->codec )
+						{
+							tag( s->codec, s->index );
+						}
+					}
+				}
+
+				// messages of a context that were rate limited so far
+				size_t dropped( const void *context )
+				{
+					if ( !context )
+					{
+						return shared_.dropped.load();
+					}
+					auto s = find( context, false );
+					return s ? s->dropped.load() : 0;
+				}
+
+				statistics stats() const
+				{
+					statistics result = { written_.load(), rate_limited_.load(), overflowed_.load() };
+					return result;
+				}
+
+				// waits until everything pushed so far has reached the sink
+				void flush()
+				{
+					auto target = head_.load();
+					while ( written_ < target )
+					{
+						std::this_thread::sleep_for( options_.interval );
+					}
+				}
+
+			private:
+
+				router( const router& );
+				router& operator = ( const router& );
+
+				struct cell
+				{
+					std::atomic< size_t > sequence;
+					record data;
+				};
+
+				struct slot
+				{
+					std::atomic< const void* > context;
+					std::atomic< int64_t > second;
+					std::atomic< size_t > count;
+					std::atomic< size_t > dropped;
+					std::atomic< int > stream;
+				};
+
+				static const int slot_bits = 8;
+				static const size_t slots = size_t( 1 ) << slot_bits;
+				// untagged slots that have been quiet for this long can be taken over once the table is full
+				static const int64_t stale_seconds = 60;
+
+				static std::atomic< router* >& active()
+				{
+					static std::atomic< router* > result( nullptr );
+					return result;
+				}
+
+				// marks a released slot, lookups probe past it and inserts may reuse it
+				static const void* tombstone()
+				{
+					static const char result = 0;
+					return &result;
+				}
+
+				static void clear( slot &s, const void *context = nullptr )
+				{
+					s.context = context;
+					s.second = -1;
+					s.count = 0;
+					s.dropped = 0;
+					s.stream = -1;
+				}
+
+				static std::atomic< size_t >& callers()
+				{
+					static std::atomic< size_t > result( 0 );
+					return result;
+				}
+
+				static void callback( void *avcl, int level, const char *fmt, va_list vl )
+				{
+					++callers();
+					if ( auto r = active().load() )
+					{
+						r->push( avcl, level, fmt, vl );
+					}
+					--callers();
+				}
+
+				// open addressing with tombstones, an insert takes the first released slot of the
+				// probe sequence once it knows the context is not further along, or failing that
+				// a stale untagged slot, nullptr when neither exists
+				slot* find( const void *context, bool insert )
+				{
+					// the multiplicative hash mixes into the high bits
+					auto h = size_t( ( uint64_t( reinterpret_cast< uintptr_t >( context ) ) * 0x9E3779B97F4A7C15ull ) >> ( 64 - slot_bits ) );
+					slot *released = nullptr;
+					for ( size_t i = 0; i < slots; ++i )
+					{
+						auto &s = slots_[ ( h + i ) & ( slots - 1 ) ];
+						auto current = s.context.load( std::memory_order_acquire );
+						if ( current == context )
+						{
+							return &s;
+						}
+						if ( current == tombstone() )
+						{
+							released = released ? released : &s;
+							continue;
+						}
+						if ( !current )
+						{
+							if ( !insert )
+							{
+								return nullptr;
+							}
+							if ( released && claim( *released, tombstone(), context ) )
+							{
+								return released;
+							}
+							const void *expected = nullptr;
+							if ( s.context.compare_exchange_strong( expected, context ) || expected == context )
+							{
+								return &s;
+							}
+						}
+					}
+					if ( !insert )
+					{
+						return nullptr;
+					}
+					if ( released && claim( *released, tombstone(), context ) )
+					{
+						return released;
+					}
+					return evict( context );
+				}
+
+				bool claim( slot &s, const void *expected, const void *context )
+				{
+					if ( !s.context.compare_exchange_strong( expected, context ) )
+					{
+						return false;
+					}
+					s.second = -1;
+					s.count = 0;
+					s.dropped = 0;
+					s.stream = -1;
+					return true;
+				}
+
+				// takes over the untagged slot that has been quiet the longest, contexts that
+				// were freed without being released end up there
+				slot* evict( const void *context )
+				{
+					auto now = std::chrono::duration_cast< std::chrono::seconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+					slot *oldest = nullptr;
+					for ( auto &s : slots_ )
+					{
+						if ( s.stream.load( std::memory_order_relaxed ) < 0 && now - s.second.load( std::memory_order_relaxed ) >= stale_seconds
+							&& ( !oldest || s.second.load( std::memory_order_relaxed ) < oldest->second.load( std::memory_order_relaxed ) ) )
+						{
+							oldest = &s;
+						}
+					}
+					if ( oldest )
+					{
+						auto expected = oldest->context.load( std::memory_order_acquire );
+						if ( expected != tombstone() && expected && claim( *oldest, expected, context ) )
+						{
+							return oldest;
+						}
+					}
+					return nullptr;
+				}
+
+				bool allow( slot &s, std::chrono::steady_clock::time_point now )
+				{
+					auto second = std::chrono::duration_cast< std::chrono::seconds >( now.time_since_epoch() ).count();
+					auto current = s.second.load( std::memory_order_relaxed );
+					if ( current != second && s.second.compare_exchange_strong( current, second ) )
+					{
+						s.count = 0;
+					}
+					return s.count.fetch_add( 1, std::memory_order_relaxed ) < options_.per_second;
+				}
+
+				void push( void *avcl, int level, const char *fmt, va_list vl )
+				{
+					if ( level > options_.level )
+					{
+						return;
+					}
+
+					auto now = std::chrono::steady_clock::now();
+					// contexts that found no slot are rate limited together, and never tagged
+					auto found = avcl ? find( avcl, true ) : nullptr;
+					auto &s = found ? *found : shared_;
+					if ( !allow( s, now ) )
+					{
+						++s.dropped;
+						++rate_limited_;
+						return;
+					}
+
+					// a bounded multi producer queue, each cell's sequence says whose turn it is
+					auto pos = head_.load( std::memory_order_relaxed );
+					cell *c = nullptr;
+					for ( ;; )
+					{
+						c = &cells_[ pos & mask_ ];
+						auto sequence = c->sequence.load( std::memory_order_acquire );
+						auto diff = intptr_t( sequence ) - intptr_t( pos );
+						if ( !diff )
+						{
+							if ( head_.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+							{
+								break;
+							}
+						}
+						else if ( diff < 0 )
+						{
+							++overflowed_;
+							return;
+						}
+						else
+						{
+							pos = head_.load( std::memory_order_relaxed );
+						}
+					}
+
+					auto &r = c->data;
+					r.level = level;
+					r.context = avcl;
+					r.stream = found ? s.stream.load( std::memory_order_relaxed ) : -1;
+					r.time = now;
+					r.name[ 0 ] = 0;
+					if ( avcl )
+					{
+						if ( auto cls = *reinterpret_cast< const AVClass* const* >( avcl ) )
+						{
+							auto name = cls->item_name ? cls->item_name( avcl ) : cls->class_name;
+							snprintf( r.name, sizeof( r.name ), "%s", name ? name : "" );
+						}
+					}
+					vsnprintf( r.message, sizeof( r.message ), fmt, vl );
+
+					c->sequence.store( pos + 1, std::memory_order_release );
+				}
+
+				// the only consumer
+				bool pop( record &out )
+				{
+					auto &c = cells_[ tail_ & mask_ ];
+					if ( c.sequence.load( std::memory_order_acquire ) != tail_ + 1 )
+					{
+						return false;
+					}
+					out = c.data;
+					c.sequence.store( tail_ + mask_ + 1, std::memory_order_release );
+					++tail_;
+					return true;
+				}
+
+				void run()
+				{
+					record r;
+					for ( ;; )
+					{
+						auto stopping = !running_;
+						while ( pop( r ) )
+						{
+							if ( options_.sink )
+							{
+								options_.sink( r );
+							}
+							++written_;
+						}
+						if ( stopping )
+						{
+							break;
+						}
+						std::this_thread::sleep_for( options_.interval );
+					}
+				}
+
+				options options_;
+				std::unique_ptr< cell[] > cells_;
+				size_t mask_;
+				std::atomic< size_t > head_;
+				size_t tail_;
+				std::array< slot, slots > slots_;
+				slot shared_;
+				std::atomic< size_t > written_, rate_limited_, overflowed_;
+				std::atomic< bool > running_;
+				std::thread drain_;
+		};
+
+		inline void release( const void *context )
+		{
+			router::forget( context );
+		}
 	}
 }
@@ -23,48 +23,12 @@ void test_manual_file_read( const string &input, const string &output )
 	vector< unsigned char > data( size );
 	file.read( reinterpret_cast< char* >( data.data() ), size );
 
-	auto inf = av_find_input_format( "mjpeg" ) || av::error( "could not find mjpeg format" );
+	av::image::decoder decoder;
+	auto frame = decoder.decode( data.data(), data.size() );
 
-	auto ioctx = av::io::context::alloc();
-	
-	uint8_t tmp[ 64 ];
-	ioctx->buffer = tmp;
-	ioctx->buf_end = tmp + sizeof( tmp );
-	ioctx->buf_ptr = tmp;
-	ioctx->buffer_size = sizeof( tmp );
-
-	auto bufstart = reinterpret_cast< uint8_t* >( data.data() );
-	auto bufend = bufstart + data.size();
-	
-	ioctx.read = [bufstart,bufend]( uint8_t *buffer, int size ) mutable
-	{
-		auto count = min< int >( bufend - bufstart, size );
-		copy( bufstart, bufstart + count, buffer );
-		bufstart += count;
-		return count;
-	};
-
-	auto f = av::format::open_input( "", av::format::make_context( ioctx ), inf );
-	
-	vector< char > buffer;
-	
-	auto henk = [output,&buffer]( AVFrame &frame )
-	{
-		buffer.resize( 3 * frame.width * frame.height );
-		
-		sws::convert( frame, buffer.data(), frame.width, AV_PIX_FMT_RGB24 );
-		
-		write_ppm( output, frame.width, frame.height, buffer.data() );
-		
-		return true;
-	};
-	
-	for ( auto &s : f.streams() )
-	{
-		s.open_input( henk );
-	}
-	
-	f.decode_all();
+	vector< char > buffer( 3 * frame->width * frame->height );
+	sws::convert( *frame, buffer.data(), 3 * frame->width, AV_PIX_FMT_RGB24 );
+	write_ppm( output, frame->width, frame->height, buffer.data() );
 }
 
 void test_file_read( const string &input, const string &output )
@@ -148,60 +112,114 @@ void test_file_write( const string &output )
 	
 	auto video = file.add_stream( AV_CODEC_ID_MJPEG );
 	
-	const auto width = 320, height = 240, bpp = 2;
-	
-	vector< uint8_t > data( width * height * bpp );
-	std::fill( data.begin(), data.end(), 0xAA );
+	const auto width = 320, height = 240;
 	
-	vector< uint8_t > convertbuffer( width * height * bpp );
+	sws::image< AV_PIX_FMT_YUYV422 > source( width, height );
+	std::fill_n( source.plane( 0 ), source.stride( 0 ) * height, 0xAA );
 	
+	sws::image< AV_PIX_FMT_YUVJ422P > converted( width, height );
 	
-	video->codec->pix_fmt = AV_PIX_FMT_YUVJ422P;
+	video->codec->pix_fmt = converted.format();
 	video->codec->width = width;
 	video->codec->height = height;
-	video->codec->gop_size = 12;
-	video->codec->qmax = 5;
-	video->codec->qmin = 2;
 	video->codec->time_base.num = 1;
 	video->codec->time_base.den = 25;
-	video->codec->bit_rate = 4000000;
+
+	av::codec::options options;
+	options.set( "g", 12 ).set( "qmin", 2 ).set( "qmax", 5 ).set( "b", 4000000 );
 	
 	auto henk = [&]( AVFrame &dstframe )
 	{
-		sws::helper src, dst;
-		src.data[ 0 ] = data.data();
-		src.stride[ 0 ] = width * bpp;
-		src.format = video->codec->pix_fmt;
-		src.width = width;
-		src.height = height;
-
-		dst.stride[ 0 ] = width;
-		dst.stride[ 1 ] = width / 2;
-		dst.stride[ 2 ] = width / 2;
-		dst.data[ 0 ] = &convertbuffer[ 0 ];
-		dst.data[ 1 ] = &convertbuffer[ 0 ] + dst.stride[ 0 ];
-		dst.data[ 2 ] = &convertbuffer[ 1 ] + dst.stride[ 1 ];
-		dst.format = AV_PIX_FMT_YUV422P;
-		dst.width = width;
-		dst.height = height;
-		
-		sws::convert( src, dst );
-		
-		dst.to_avframe( dstframe );
-		
+		sws::convert( source, converted );
+		converted.to_avframe( dstframe );
 		return true;
-
-//		sws::pointers_t pointers( dstframe.data, dstframe.data + AV_NUM_DATA_POINTERS );
-//		sws::strides_t strides( dstframe.linesize, dstframe.linesize + AV_NUM_DATA_POINTERS );
-//		
-//		sws::convert( tmpframe, pointers, strides, AV_PIX_FMT_YUV422P );
 	};
 	
-	video.open_output( henk );
+	for ( auto &rejected : video.open_output( henk, options ) )
+	{
+		cerr << "option not recognized: " << rejected << endl;
+	}
 	
 	av::packet p;
 	auto frame = av::frame::alloc();
 	file.encode( p, frame );
+	file.finish();
+}
+
+void test_memory_write( const string &output )
+{
+	av::io::memory_output out;
+
+	{
+		auto file = av::format::open_output( out, "mjpeg" );
+
+		auto video = file.add_stream( AV_CODEC_ID_MJPEG );
+
+		const auto width = 320, height = 240;
+
+		sws::image< AV_PIX_FMT_YUVJ422P > image( width, height );
+		for ( auto plane = 0; plane < 3; ++plane )
+		{
+			std::fill_n( image.plane( plane ), image.stride( plane ) * image.height( plane ), 0x80 );
+		}
+
+		video->codec->pix_fmt = image.format();
+		video->codec->width = width;
+		video->codec->height = height;
+		video->codec->time_base.num = 1;
+		video->codec->time_base.den = 25;
+
+		auto henk = [&]( AVFrame &frame )
+		{
+			image.to_avframe( frame );
+			frame.pts = 0;
+			return true;
+		};
+
+		video.open_output( henk );
+
+		av::packet p;
+		auto frame = av::frame::alloc();
+		file.encode( p, frame );
+		file.finish();
+	}
+
+	ofstream jpeg( output, ios::binary );
+	for ( auto &segment : out.release() )
+	{
+		jpeg.write( reinterpret_cast< const char* >( segment.data() ), segment.size() );
+	}
+}
+
+void test_image_write( const string &output )
+{
+	const auto width = 320, height = 240;
+
+	sws::image< AV_PIX_FMT_YUVJ420P > image( width, height );
+	for ( auto y = 0; y < height; ++y )
+	{
+		std::fill_n( image.row( 0, y ), width, uint8_t( y ) );
+	}
+	for ( auto plane = 1; plane < 3; ++plane )
+	{
+		std::fill_n( image.plane( plane ), image.stride( plane ) * image.height( plane ), 0x80 );
+	}
+
+	av::image::encoder_pool encoders;
+	vector< uint8_t > jpeg;
+	encoders.encode( image.helper(), jpeg );
+
+	ofstream( output, ios::binary ).write( reinterpret_cast< const char* >( jpeg.data() ), jpeg.size() );
+}
+
+void print_memory()
+{
+	for ( auto i = 0u; i < av::memory::kinds; ++i )
+	{
+		auto k = static_cast< av::memory::kind >( i );
+		auto u = av::memory::get( k );
+		cerr << av::memory::name( k ) << ": " << u.count << " live (" << u.overhead << " bytes overhead), peak " << u.peak_count << " (" << u.peak_overhead << " bytes overhead)" << endl;
+	}
 }
 
 int main( int argc, char **argv )
@@ -214,6 +232,9 @@ int main( int argc, char **argv )
 //		test_file_read( "test.jpg", "out2.ppm" );
 //		sin_to_mp3( "test.wav", "out.mp3" );
 		test_file_write( "out.mjpeg" );
+		test_memory_write( "out_memory.mjpeg" );
+//		test_image_write( "out_image.jpg" );
+		print_memory();
 	}
 	catch( const exception &err )
 	{